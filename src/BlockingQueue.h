@@ -27,7 +27,7 @@ public:
 		while (queue_.empty()) {
 			item_cond_.wait(_lock);
 		}
-		T x = queue_.front();
+		T x = std::move(queue_.front());
 		queue_.pop();
 		slot_cond_.notify_one();
 		return x;
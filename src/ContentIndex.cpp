@@ -0,0 +1,296 @@
+#include "ContentIndex.h"
+
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <vector>
+#include <algorithm>
+
+namespace {
+
+const uint64_t P1 = 11400714785074694791ULL;
+const uint64_t P2 = 14029467366897019727ULL;
+const uint64_t P3 = 1609587929392839161ULL;
+const uint64_t P4 = 9650029242287828579ULL;
+const uint64_t P5 = 2870177450012600261ULL;
+
+// files are read and hashed buffer by buffer, a multiple of the
+// 32 bytes stripe, so no carry between buffers.
+const size_t kBufferSize = 1 << 20;
+
+inline uint64_t rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t read64(const unsigned char* p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+inline uint32_t read32(const unsigned char* p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+inline uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+	acc += input * P2;
+	acc = rotl(acc, 31);
+	return acc * P1;
+}
+
+inline uint64_t merge_round(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh_round(0, val);
+	return acc * P1 + P4;
+}
+
+// incremental XXH64
+class Hasher
+{
+public:
+	Hasher() : v1_(P1 + P2), v2_(P2), v3_(0), v4_(-P1), total_(0) {}
+
+	// all but the last call must pass a multiple of 32 bytes
+	void update(const unsigned char* p, size_t len) {
+		total_ += len;
+		const unsigned char* end = p + len;
+		for (; p + 32 <= end; p += 32) {
+			v1_ = xxh_round(v1_, read64(p));
+			v2_ = xxh_round(v2_, read64(p + 8));
+			v3_ = xxh_round(v3_, read64(p + 16));
+			v4_ = xxh_round(v4_, read64(p + 24));
+		}
+		tail_ = p;
+		tail_len_ = end - p;
+	}
+
+	uint64_t digest() const {
+		uint64_t h;
+		if (total_ >= 32) {
+			h = rotl(v1_, 1) + rotl(v2_, 7) + rotl(v3_, 12) + rotl(v4_, 18);
+			h = merge_round(h, v1_);
+			h = merge_round(h, v2_);
+			h = merge_round(h, v3_);
+			h = merge_round(h, v4_);
+		} else {
+			h = P5;
+		}
+		h += total_;
+
+		const unsigned char* p = tail_;
+		size_t len = tail_len_;
+		for (; len >= 8; p += 8, len -= 8) {
+			h ^= xxh_round(0, read64(p));
+			h = rotl(h, 27) * P1 + P4;
+		}
+		if (len >= 4) {
+			h ^= (uint64_t) read32(p) * P1;
+			h = rotl(h, 23) * P2 + P3;
+			p += 4;
+			len -= 4;
+		}
+		for (; len > 0; p++, len--) {
+			h ^= (*p) * P5;
+			h = rotl(h, 11) * P1;
+		}
+
+		h ^= h >> 33;
+		h *= P2;
+		h ^= h >> 29;
+		h *= P3;
+		h ^= h >> 32;
+		return h;
+	}
+
+private:
+	uint64_t v1_, v2_, v3_, v4_;
+	uint64_t total_;
+	const unsigned char* tail_{nullptr};
+	size_t tail_len_{0};
+};
+
+}  // namespace
+
+ContentIndex::ContentIndex()
+	: seq_(0)
+{
+}
+
+ContentIndex::~ContentIndex()
+{
+}
+
+bool ContentIndex::hash_file(const std::string& path, uint64_t* hash, uint64_t* size)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return false;
+	}
+
+	// read, not mapped: a file truncated meanwhile would raise SIGBUS,
+	// it's hashed up to where it ends now instead
+	static thread_local std::vector<unsigned char> buf(kBufferSize);
+	Hasher hasher;
+	uint64_t length = 0;
+	for (;;) {
+		size_t filled = 0;
+		while (filled < buf.size()) {
+			ssize_t n = pread(fd, &buf[filled], buf.size() - filled, length + filled);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n < 0) {
+				close(fd);
+				return false;
+			}
+			if (n == 0) {
+				break;
+			}
+			filled += n;
+		}
+		hasher.update(&buf[0], filled);
+		length += filled;
+		if (filled < buf.size()) {  // the end, the only partial update
+			break;
+		}
+	}
+	*hash = hasher.digest();
+	*size = length;
+	close(fd);
+	return true;
+}
+
+bool ContentIndex::add_tree(std::string root)
+{
+	{
+		std::lock_guard<std::mutex> _l(mutex_);
+		if (roots_[root]++ > 0) {
+			return false;
+		}
+	}
+	add_subtree(root);
+	return true;
+}
+
+void ContentIndex::remove_tree(std::string root)
+{
+	std::lock_guard<std::mutex> _l(mutex_);
+	auto rit = roots_.find(root);
+	if (rit == roots_.end() || --rit->second > 0) {
+		return;
+	}
+	roots_.erase(rit);
+	std::string prefix = root.back() == '/' ? root : root + "/";
+	for (auto it = files_.begin(); it != files_.end();) {
+		if (it->first == root || it->first.compare(0, prefix.size(), prefix) == 0) {
+			it = files_.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+bool ContentIndex::has_tree(std::string root) const
+{
+	std::lock_guard<std::mutex> _l(mutex_);
+	return roots_.count(root) > 0;
+}
+
+// `path` is used as a scratch buffer and restored before return
+void ContentIndex::add_subtree(std::string& path)
+{
+	DIR* dir = opendir(path.c_str());
+	if (!dir) {  // a single file
+		add_file(path);
+		return;
+	}
+	size_t len = path.size();
+	while (struct dirent* ent = readdir(dir)) {
+		const char* name = ent->d_name;
+		if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) {
+			continue;
+		}
+		if (path.back() != '/') {
+			path.push_back('/');
+		}
+		path.append(name);
+		struct stat st;
+		if (ent->d_type == DT_REG) {
+			add_file(path);
+		} else if (ent->d_type == DT_DIR) {
+			add_subtree(path);
+		} else if (ent->d_type == DT_UNKNOWN && lstat(path.c_str(), &st) == 0) {
+			if (S_ISREG(st.st_mode)) add_file(path);
+			if (S_ISDIR(st.st_mode)) add_subtree(path);
+		}
+		path.resize(len);
+	}
+	closedir(dir);
+}
+
+// a file found by a tree walk, not a change to anyone: it keeps the
+// current sequence number, which services deployed since start from
+void ContentIndex::add_file(const std::string& path)
+{
+	Fingerprint fp;
+	if (!hash_file(path, &fp.hash, &fp.size)) {
+		return;
+	}
+	fp.exists = true;
+	std::lock_guard<std::mutex> _l(mutex_);
+	fp.seq = seq_;
+	files_.insert(std::make_pair(path, fp));  // an update meanwhile is newer
+}
+
+uint64_t ContentIndex::update(std::string path)
+{
+	Fingerprint fp;
+	fp.exists = hash_file(path, &fp.hash, &fp.size);
+
+	std::lock_guard<std::mutex> _l(mutex_);
+	auto it = files_.find(path);
+	if (it == files_.end()) {
+		if (!fp.exists) {
+			return 0;  // directories never change
+		}
+		it = files_.insert(std::make_pair(path, Fingerprint())).first;
+	} else if (it->second.exists == fp.exists &&
+			(!fp.exists || (it->second.size == fp.size && it->second.hash == fp.hash))) {
+		return it->second.seq;
+	}
+	fp.seq = ++seq_;
+	it->second = fp;
+	return fp.seq;
+}
+
+uint64_t ContentIndex::seq() const
+{
+	std::lock_guard<std::mutex> _l(mutex_);
+	return seq_;
+}
+
+void ContentIndex::erase(std::string path)
+{
+	std::lock_guard<std::mutex> _l(mutex_);
+	files_.erase(path);
+}
+
+size_t ContentIndex::size() const
+{
+	std::lock_guard<std::mutex> _l(mutex_);
+	return files_.size();
+}
@@ -0,0 +1,64 @@
+#ifndef _CONTENT_INDEX_H_
+#define _CONTENT_INDEX_H_
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <stdint.h>
+#include <unordered_map>
+
+// content fingerprints of watched files, to tell a real change
+// from a `touch` or a rewrite with identical bytes.
+//
+// The fingerprints are shared by the services watching a tree, each file
+// keeps the sequence number of its last content change, so every service
+// compares against what it saw last rather than against the others.
+class ContentIndex
+{
+public:
+	ContentIndex();
+
+	~ContentIndex();
+
+	// fingerprint all regular files under `root`, once per root, return
+	// false if it was added already, each add needs a `remove_tree()`
+	bool add_tree(std::string root);
+
+	// forget `root` and the files under it once removed as many times
+	void remove_tree(std::string root);
+
+	bool has_tree(std::string root) const;
+
+	// re-hash `path`, return the sequence number of its last content
+	// change, removal included, 0 if never seen
+	uint64_t update(std::string path);
+
+	// of the last change, changes before it are older than now
+	uint64_t seq() const;
+
+	void erase(std::string path);
+
+	size_t size() const;
+
+	// 64-bit non-cryptographic hash (XXH64) of the file content
+	static bool hash_file(const std::string& path, uint64_t* hash, uint64_t* size);
+
+private:
+	struct Fingerprint {
+		uint64_t size;
+		uint64_t hash;
+		uint64_t seq;   // of the last change
+		bool exists;    // false once removed, so it's a change to all
+	};
+
+	void add_subtree(std::string& path);
+	void add_file(const std::string& path);
+
+private:
+	std::map<std::string, int> roots_;  // -> times added
+	std::unordered_map<std::string, Fingerprint> files_;
+	uint64_t seq_;
+	mutable std::mutex mutex_;
+};
+
+#endif  // _CONTENT_INDEX_H_
@@ -0,0 +1,198 @@
+#include "ControlServer.h"
+#include "EpollPoller.h"
+#include "ListenSocket.h"
+#include "RuntimeError.h"
+
+#include <unistd.h>
+#include <sys/socket.h>
+
+using namespace std::placeholders;
+
+const size_t ControlServer::kMaxLine;
+const size_t ControlServer::kMaxInFlight;
+
+ControlServer::ControlServer(Handler handler, EpollPoller* poller)
+	: handler_(handler), poller_(poller), fd_(-1), next_id_(0)
+{
+}
+
+ControlServer::~ControlServer()
+{
+	for (auto& kv: clients_) {
+		close(kv.second.fd);
+	}
+	if (fd_ >= 0) {
+		close(fd_);
+		if (path_[0] != '@') {
+			unlink(path_.c_str());
+		}
+	}
+}
+
+void ControlServer::listen(const std::string& path)
+{
+	fd_ = ListenSocket::open_unix(path);
+	path_ = path;
+}
+
+int ControlServer::get_fd()
+{
+	return fd_;
+}
+
+void ControlServer::on_fd_events(int fd, short events)
+{
+	for (;;) {  // accept until EAGAIN, the fd may be edge triggered
+		int sock = accept4(fd_, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sock < 0) {
+			if (errno == ECONNABORTED || errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EMFILE || errno == ENFILE) {
+				break;  // out of fds, try again on the next connection
+			}
+			throw RuntimeError("accept failed");
+		}
+		uint64_t id = ++next_id_;
+		Client& client = clients_[id];
+		client.fd = sock;
+		client.eof = false;
+		client.next_seq = 0;
+		client.sent_seq = 0;
+		// writable too, for answers left by a full socket buffer
+		poller_->add_fd(sock, std::bind(&ControlServer::on_client_events, this, id, _1, _2),
+			EPOLLIN | EPOLLOUT | EPOLLET);
+	}
+}
+
+void ControlServer::on_client_events(uint64_t id, int fd, short events)
+{
+	auto it = clients_.find(id);
+	if (it == clients_.end()) {
+		return;
+	}
+	Client& client = it->second;
+	if (!flush(client)) {
+		close_client(id);
+		return;
+	}
+	read_requests(id, client);
+}
+
+// an answer is done, write it and the ones after it already done
+void ControlServer::on_reply(uint64_t id, uint64_t seq, std::string answer)
+{
+	auto it = clients_.find(id);
+	if (it == clients_.end()) {
+		return;  // gone meanwhile
+	}
+	Client& client = it->second;
+	client.answers[seq] = std::move(answer);
+	if (!flush(client)) {
+		close_client(id);
+		return;
+	}
+	// may have stopped reading at `kMaxInFlight`
+	read_requests(id, client);
+}
+
+// hand the whole lines to the handler, read more until EAGAIN or too many
+// in flight, and close the client once it hung up and all is answered
+void ControlServer::read_requests(uint64_t id, Client& client)
+{
+	for (;;) {
+		size_t begin = 0, end;
+		while (client.next_seq - client.sent_seq < kMaxInFlight &&
+				(end = client.in.find('\n', begin)) != std::string::npos) {
+			std::string line = client.in.substr(begin, end - begin);
+			begin = end + 1;
+			if (line.size() && line.back() == '\r') {
+				line.pop_back();
+			}
+			if (line.empty()) {
+				continue;
+			}
+			uint64_t seq = client.next_seq++;
+			handler_(line, [this, id, seq](std::string answer) {
+				poller_->post(std::bind(&ControlServer::on_reply, this, id, seq, std::move(answer)));
+			});
+		}
+		client.in.erase(0, begin);
+
+		if (client.next_seq - client.sent_seq >= kMaxInFlight) {
+			return;  // read again once answered
+		}
+		if (client.in.size() >= kMaxLine) {
+			// answer it in turn, and hang up
+			client.answers[client.next_seq++] = "error line too long";
+			client.in.clear();
+			client.eof = true;
+			if (!flush(client)) {
+				close_client(id);
+				return;
+			}
+		}
+		if (client.eof) {
+			if (client.sent_seq == client.next_seq && client.out.empty()) {
+				close_client(id);
+			}
+			return;
+		}
+
+		char buf[4096];
+		ssize_t n = read(client.fd, buf, sizeof(buf));
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN) {
+				close_client(id);
+			}
+			return;
+		}
+		if (n == 0) {
+			client.eof = true;  // half closed, still answered
+			continue;
+		}
+		client.in.append(buf, n);
+	}
+}
+
+// write the answers in order, false if the client is gone
+bool ControlServer::flush(Client& client)
+{
+	for (auto it = client.answers.find(client.sent_seq); it != client.answers.end();
+			it = client.answers.find(client.sent_seq)) {
+		client.out += it->second;
+		client.out += '\n';
+		client.answers.erase(it);
+		client.sent_seq++;
+	}
+	size_t off = 0;
+	while (off < client.out.size()) {
+		ssize_t n = send(client.fd, client.out.data() + off, client.out.size() - off, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN) {
+				break;  // the rest on EPOLLOUT
+			}
+			return false;
+		}
+		off += n;
+	}
+	client.out.erase(0, off);
+	return true;
+}
+
+void ControlServer::close_client(uint64_t id)
+{
+	auto it = clients_.find(id);
+	if (it == clients_.end()) {
+		return;
+	}
+	poller_->remove_fd(it->second.fd);
+	close(it->second.fd);
+	clients_.erase(it);
+}
@@ -0,0 +1,69 @@
+#ifndef _CONTROL_SERVER_H_
+#define _CONTROL_SERVER_H_
+
+#include <map>
+#include <string>
+#include <stdint.h>
+#include <functional>
+
+class EpollPoller;
+
+// Serves a line protocol on a unix stream socket: every request is a line,
+// answered by one line, in order. A client may send many requests without
+// waiting for the answers, e.g. `socat - UNIX-CONNECT:<path>`.
+//
+// Clients are handled in the loop thread of `poller`, which only splits
+// the lines and writes the answers back. The requests are handed to
+// `handler` with a `Reply` to call once done, from any thread, so slow
+// ones don't stall the loop. At most `kMaxInFlight` requests of a client
+// are unanswered at a time, the socket isn't read beyond that.
+class ControlServer
+{
+public:
+	// answer of a request, once, thread safe
+	typedef std::function<void(std::string)> Reply;
+	typedef std::function<void(const std::string& line, Reply reply)> Handler;
+
+	ControlServer(Handler handler, EpollPoller* poller);
+
+	~ControlServer();
+
+	// "@name" for the abstract namespace
+	void listen(const std::string& path);
+
+	bool listening() const { return fd_ >= 0; }
+
+	void on_fd_events(int fd, short events);
+
+	int get_fd();
+
+	static const size_t kMaxLine = 64 * 1024;
+	static const size_t kMaxInFlight = 1024;
+
+private:
+	struct Client {
+		int fd;
+		bool eof;
+		std::string in;    // read, not a whole line yet
+		std::string out;   // answers not written yet
+		uint64_t next_seq;  // of the next request
+		uint64_t sent_seq;  // of the next answer to write
+		std::map<uint64_t, std::string> answers;  // done, out of order
+	};
+
+	void on_client_events(uint64_t id, int fd, short events);
+	void on_reply(uint64_t id, uint64_t seq, std::string answer);
+	void read_requests(uint64_t id, Client& client);
+	bool flush(Client& client);
+	void close_client(uint64_t id);
+
+private:
+	Handler handler_;
+	EpollPoller* poller_;
+	int fd_;
+	std::string path_;
+	uint64_t next_id_;
+	std::map<uint64_t, Client> clients_;  // loop thread only
+};
+
+#endif  // _CONTROL_SERVER_H_
@@ -1,31 +1,74 @@
 #include "DeployWorker.h"
 #include "RuntimeError.h"
+#include "ListenSocket.h"
+#include "Logger.h"
 
 #include <string.h>
 #include <limits.h>
+#include <unistd.h>
+#include <iterator>
+#include <algorithm>
 #include <stdexcept>
 
 using namespace fsevent;
 using namespace std::placeholders;
 
-const static long kMaxRedeployInterval = 64;
-const static long kDelayUnit = 1000; // ms
+const static long kStopPollInterval = 20; // ms
 
-DeployWorker::DeployWorker()
-	: queue_(1024),
+DeployWorker::DeployWorker(bool single_thread)
+	: single_thread_(single_thread),
+	  metrics_(),
+	  queue_(4096),
+	  poller_(&metrics_),
 	  scheduler_(),
-	  fs_watcher_(std::bind(&DeployWorker::FsEventCallback, this, _1, _2)),
-	  process_watcher_(std::bind(&DeployWorker::ProcessCallback, this, _1, _2))
+	  fs_watcher_(std::bind(&DeployWorker::FsEventCallback, this, -1, 0, _1), &metrics_),
+	  poll_watcher_(std::bind(&DeployWorker::FsEventCallback, this, -1, 0, _1), 4, &metrics_),
+	  process_watcher_(std::bind(&DeployWorker::ProcessCallback, this, _1, _2), &poller_, &metrics_),
+	  notify_socket_(std::bind(&DeployWorker::NotifyCallback, this, _1, _2)),
+	  metrics_server_(&metrics_, &poller_),
+	  health_checker_(&poller_, &process_watcher_, &metrics_),
+	  control_server_(std::bind(&DeployWorker::ControlCallback, this, _1, _2), &poller_),
+	  random_(std::random_device()()),
+	  max_starting_(0),
+	  start_seq_(0)
 {
+	task_wait_ = metrics_.histogram("autodeploy_task_wait_seconds{queue=\"handler\"}",
+		"Time from posting a task to running it.");
+	change_restarts_ = metrics_.counter("autodeploy_restarts_total{reason=\"change\"}", "Restarts requested.");
+	exit_restarts_ = metrics_.counter("autodeploy_restarts_total{reason=\"exit\"}", "Restarts requested.");
+	request_restarts_ = metrics_.counter("autodeploy_restarts_total{reason=\"request\"}", "Restarts requested.");
+	ready_time_ = metrics_.histogram("autodeploy_ready_seconds", "Time from spawning a process to it ready.");
+	stop_time_ = metrics_.histogram("autodeploy_stop_seconds", "Time from SIGTERM to the process group gone.");
+	unhealthy_ = metrics_.counter("autodeploy_unhealthy_total", "Processes killed for failing health checks.");
+	metrics_.gauge("autodeploy_pending_tasks{queue=\"handler\"}", "Tasks posted, not run yet.",
+		[this] { return (double) queue_.size(); });
+	metrics_.gauge("autodeploy_services", "Deployed services.", [this] {
+		std::lock_guard<std::mutex> _l(mutex_);
+		return (double) names_.size();
+	});
+	metrics_.gauge("autodeploy_starting", "Starts in progress.", [this] {
+		std::lock_guard<std::mutex> _l(mutex_);
+		return (double) starting_.size();
+	});
+	metrics_.gauge("autodeploy_start_queue", "Starts waiting for a slot.", [this] {
+		std::lock_guard<std::mutex> _l(mutex_);
+		return (double) start_queue_.size();
+	});
+	metrics_.counter("autodeploy_log_dropped_records_total", "Log records dropped on a full ring.",
+		[] { return (double) Logger::drops(); });
 }
 
 DeployWorker::~DeployWorker()
 {
 	if (started_) stop();
-	if (works_.size()) {
-		for (auto& e: works_) {
-			undeloy(e.first);
+	{
+		std::lock_guard<std::mutex> _l(mutex_);
+		for (size_t id = 0; id < services_.size(); id++) {
+			if (services_[id].active) {
+				release_service(id);
+			}
 		}
+		admitted_.clear();  // nothing starts any more
 	}
 	if (poller_thread_.joinable()) {
 		poller_thread_.join();
@@ -45,59 +88,511 @@ std::string abspath(std::string path)
 	return 	filename;
 }
 
-pid_t DeployWorker::deploy(std::vector<std::string> args, std::string path)
+static std::vector<std::string> split_lines(const std::string& text)
+{
+	std::vector<std::string> lines;
+	size_t begin = 0;
+	while (begin < text.size()) {
+		size_t end = text.find('\n', begin);
+		if (end == text.npos) {
+			end = text.size();
+		}
+		lines.push_back(text.substr(begin, end - begin));
+		begin = end + 1;
+	}
+	return lines;
+}
+
+pid_t DeployWorker::deploy(std::vector<std::string> args, std::string path, Policy policy)
 {
-	if (args.size() == 0) {
+	ServiceSpec spec;
+	spec.args = args;
+	spec.paths.push_back(path);
+	spec.policy = policy;
+	return deploy(spec);
+}
+
+pid_t DeployWorker::deploy(ServiceSpec spec, bool replace)
+{
+	if (spec.args.size() == 0) {
 		throw std::invalid_argument("args.size() must > 0");
 	}
-	path = abspath(path);
-	args[0] = abspath(args[0]);
+	for (auto& path: spec.paths) {
+		path = abspath(path);
+	}
+	spec.args[0] = abspath(spec.args[0]);
 
-	pid_t pid = process_watcher_.spwan_process(args);
-	fs_watcher_.add_watch(path, ATTRIB | MODIFY);
+	HealthChecker::Spec health;
+	if (spec.policy.health.size()) {
+		health = HealthChecker::parse(spec.policy.health);
+		if (health.type == HealthChecker::EXEC) {
+			std::vector<std::string> args = health.cmd.args();
+			args[0] = abspath(args[0]);
+			health.cmd = ProcessWatcher::Command(args);
+		}
+		health.interval_ms = std::max(1L, spec.policy.health_interval_ms);
+		health.timeout_ms = std::max(1L, spec.policy.health_timeout_ms);
+		health.failures = std::max(1, spec.policy.health_failures);
+	}
 
-	std::lock_guard<std::mutex> _l(mutex_);
-	works_[pid] = {pid, path, args};
+	// checked again below, but don't hash a tree for a duplicate
+	if (spec.name.size() && !replace) {
+		std::lock_guard<std::mutex> _l(mutex_);
+		if (names_.count(spec.name)) {
+			throw std::invalid_argument("service " + spec.name + " exists");
+		}
+	}
 
-	return pid;
+	// set up before taking `mutex_`: an OutputLog registers its metrics,
+	// and rendering them calls our gauges, which take `mutex_`, and a
+	// recursive watch walks its whole tree
+	std::vector<std::string> indexed;  // trees added to the index by this deploy
+	std::vector<int> listen_fds;
+	std::shared_ptr<OutputLog> output;
+	std::vector<std::pair<WatchBackend*, int>> watches;
+	int id = -1;  // the slot, reserved for the callbacks of the watches
+	uint32_t gen = 0;
+	std::string name = spec.name;
+	auto release = [&]() {
+		for (auto& w: watches) {
+			w.first->remove_watch(w.second);
+		}
+		for (auto& root: indexed) {
+			content_index_.remove_tree(root);
+		}
+		for (int fd: listen_fds) {
+			close(fd);
+		}
+		if (output) {
+			output->close();
+		}
+		if (id >= 0) {
+			std::lock_guard<std::mutex> _l(mutex_);
+			services_[id].gen++;  // the events queued meanwhile are stale
+			free_ids_.push_back(id);
+		}
+	};
+	try {
+		if (spec.policy.content_hash) {
+			for (auto& path: spec.paths) {
+				content_index_.add_tree(path);
+				indexed.push_back(path);
+			}
+		}
+		for (auto& addr: spec.listens) {
+			listen_fds.push_back(ListenSocket::open(addr));
+		}
+		if (spec.policy.log_file.size()) {
+			output = std::make_shared<OutputLog>(spec.policy.log_file, &poller_, &metrics_);
+			output->set_rotation(spec.policy.log_max_bytes, spec.policy.log_files);
+			output->set_rate(spec.policy.log_rate);
+			output->set_tail(spec.policy.tail_bytes);
+			output->open();
+		}
+
+		{
+			std::lock_guard<std::mutex> _l(mutex_);
+			id = services_.size();
+			if (free_ids_.size()) {
+				id = free_ids_.back();
+				free_ids_.pop_back();
+			} else {
+				services_.push_back(Service());
+			}
+			gen = services_[id].gen;  // inactive until registered below
+		}
+		if (name.empty()) {
+			name = "service-" + std::to_string(id);
+		}
+
+		// services watching the same path share the kernel watches
+		for (auto& path: spec.paths) {
+			WatchBackend* watcher = &fs_watcher_;
+			auto mode = spec.policy.watch_mode;
+			if (mode == Policy::WATCH_POLL || (mode == Policy::WATCH_AUTO && PollingWatcher::needs_polling(path))) {
+				LOGI(Logger::Fields().add("service", name).add("path", path), "polling");
+				watcher = &poll_watcher_;
+			}
+			uint32_t mask = ATTRIB | MODIFY | (spec.policy.recursive ? RECURSIVE : 0);
+			int handle = watcher->add_watch(path, mask, std::bind(&DeployWorker::FsEventCallback, this, id, gen, _1));
+			watches.push_back(std::make_pair(watcher, handle));
+		}
+	} catch (...) {
+		release();
+		throw;
+	}
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	auto old = spec.name.size() ? names_.find(spec.name) : names_.end();
+	if (old != names_.end()) {
+		if (!replace) {
+			lock.unlock();
+			release();
+			throw std::invalid_argument("service " + spec.name + " exists");
+		}
+		// nothing left to fail, the new one takes its place
+		release_service(old->second);
+	}
+
+	Service& svc = services_[id];
+	svc.active = true;
+	svc.name = name;
+	svc.cmd = ProcessWatcher::Command(spec.args);
+	svc.listen_fds = listen_fds;
+	if (listen_fds.size()) {
+		svc.cmd.set_listen_fds(listen_fds);
+	}
+	svc.output = output;
+	if (output) {
+		svc.cmd.set_output(output->write_fd());
+	}
+	if (spec.policy.notify) {
+		svc.cmd.set_env("NOTIFY_SOCKET", notify_socket_.path());
+	}
+	svc.paths = spec.paths;
+	svc.watches = watches;
+	svc.policy = spec.policy;
+	svc.content_seq = content_index_.seq();
+	names_[svc.name] = id;
+
+	if (svc.policy.health.size()) {
+		// failures count once the process is ready
+		svc.health = health_checker_.add(health, [this, id, gen](const std::string& reason) {
+			post(std::bind(&DeployWorker::on_unhealthy, this, id, gen, reason));
+		});
+	}
+
+	lock.unlock();
+
+	request_start(id, gen, false, std::bind(&DeployWorker::restart_service, this, id, gen));
+
+	lock.lock();
+	return services_[id].gen == gen ? services_[id].pid : 0;
+}
+
+bool DeployWorker::undeploy(std::string name)
+{
+	AdmittedStarts _starts(this);
+	std::lock_guard<std::mutex> _l(mutex_);
+	auto it = names_.find(name);
+	if (it == names_.end()) {
+		return false;
+	}
+	release_service(it->second);
+	return true;
 }
 
 bool DeployWorker::undeloy(pid_t pid)
 {
+	AdmittedStarts _starts(this);
 	std::lock_guard<std::mutex> _l(mutex_);
-	auto it = works_.find(pid);
-	if (it != works_.end()) {
-		process_watcher_.kill_process(pid);
-		fs_watcher_.remove_watch(it->second.path);
-		works_.erase(pid);
+	auto it = pids_.find(pid);
+	if (it == pids_.end()) {
+		return false;
+	}
+	release_service(it->second);
+	return true;
+}
+
+std::string DeployWorker::tail(const std::string& name)
+{
+	std::shared_ptr<OutputLog> output;
+	{
+		std::lock_guard<std::mutex> _l(mutex_);
+		auto it = names_.find(name);
+		if (it == names_.end()) {
+			return std::string();
+		}
+		output = services_[it->second].output;
+	}
+	return output ? output->tail() : std::string();
+}
+
+// the last lines a crashed process wrote, may miss what's still in the pipe
+static void log_tail(const std::string& name, const std::string& tail)
+{
+	const size_t kLines = 5;
+	std::vector<std::string> lines = split_lines(tail);
+	for (size_t i = lines.size() > kLines ? lines.size() - kLines : 0; i < lines.size(); i++) {
+		LOGW(Logger::Fields().add("service", name), "%s", lines[i].c_str());
+	}
+}
+
+DeployWorker::Service* DeployWorker::get_service(int id, uint32_t gen)
+{
+	if (id < 0 || id >= (int) services_.size()) {
+		return nullptr;
+	}
+	Service& svc = services_[id];
+	if (!svc.active || svc.gen != gen) {
+		return nullptr;
+	}
+	return &svc;
+}
+
+// spawn a process of the service as `pid`, or `next_pid` if `replacement`,
+// and wait for it to be ready
+pid_t DeployWorker::spawn(int id, bool replacement)
+{
+	Service& svc = services_[id];
+	pid_t pid = process_watcher_.spwan_process(svc.cmd);
+	if (pid < 0) {
+		if (!replacement) {
+			svc.started = std::chrono::steady_clock::now();  // no backoff reset
+		}
+		return pid;
+	}
+	pids_[pid] = id;
+	LOGI(Logger::Fields().add("service", svc.name).add("pid", pid), "process spawned");
+	if (replacement) {
+		svc.next_pid = pid;
+		svc.next_started = std::chrono::steady_clock::now();
+	} else {
+		svc.pid = pid;
+		svc.state = STARTING;
+		svc.started = std::chrono::steady_clock::now();
+	}
+
+	uint32_t gen = svc.gen;
+	if (svc.policy.notify) {
+		if (svc.policy.start_timeout_ms > 0) {
+			scheduler_.schedule([this, id, gen, pid]() {
+				post(std::bind(&DeployWorker::on_start_timeout, this, id, gen, pid));
+			}, std::chrono::milliseconds(svc.policy.start_timeout_ms));
+		}
+	} else {
+		scheduler_.schedule([this, id, gen, pid]() {
+			post(std::bind(&DeployWorker::on_ready, this, id, gen, pid));
+		}, std::chrono::milliseconds(svc.policy.ready_ms));
+	}
+	return pid;
+}
+
+// kill the process, drop the watches, and free the slot
+void DeployWorker::release_service(int id)
+{
+	Service& svc = services_[id];
+	for (pid_t pid: {svc.pid, svc.next_pid}) {
+		if (pid > 0) {
+			pids_.erase(pid);
+			stop_process(pid, svc.policy.stop_timeout_ms);
+		}
+	}
+	for (auto& w: svc.watches) {
+		w.first->remove_watch(w.second);
+	}
+	svc.watches.clear();
+	names_.erase(svc.name);
+	for (int fd: svc.listen_fds) {
+		close(fd);
+	}
+	if (svc.output) {
+		svc.output->close();
+	}
+	if (svc.health) {
+		health_checker_.remove(svc.health);
+	}
+	if (svc.policy.content_hash) {
+		for (auto& path: svc.paths) {
+			content_index_.remove_tree(path);
+		}
+	}
+
+	// drop its queued starts, and give its slots to others
+	for (auto it = start_queue_.begin(); it != start_queue_.end();) {
+		if (it->second.id == id) {
+			it = start_queue_.erase(it);
+		} else {
+			++it;
+		}
 	}
+	finish_start(id, svc.gen, false);
+	finish_start(id, svc.gen, true);
+
+	uint32_t gen = svc.gen + 1;
+	svc = Service();
+	svc.gen = gen;
+	free_ids_.push_back(id);
+}
+
+// run `start` once less than `max_starting_` starts are in progress,
+// higher priority first, FIFO within a priority. A start is in progress
+// until the process it spawned is ready or failed, and `start` must call
+// `finish_start()` itself if it spawns nothing. Queued starts are run by
+// the caller of `finish_start()` once it released `mutex_`.
+void DeployWorker::request_start(int id, uint32_t gen, bool replacement, std::function<void()> start)
+{
+	StartKey key(id, gen, replacement);
+	{
+		std::lock_guard<std::mutex> _l(mutex_);
+		if (!get_service(id, gen)) {
+			return;
+		}
+		bool busy = max_starting_ > 0 && starting_.size() >= max_starting_;
+		if (busy || starting_.count(key)) {
+			// one start of a kind at a time per service, queue the others
+			for (auto& kv: start_queue_) {
+				if (kv.second.key() == key) {
+					return;
+				}
+			}
+			StartOrder order(-services_[id].policy.priority, start_seq_++);
+			start_queue_[order] = PendingStart{id, gen, replacement, start};
+			LOGI(Logger::Fields().add("service", services_[id].name), "start queued, %zu in progress, %zu queued",
+				starting_.size(), start_queue_.size());
+			return;
+		}
+		starting_.insert(key);
+	}
+	start();
+}
+
+// with `mutex_` held
+void DeployWorker::finish_start(int id, uint32_t gen, bool replacement)
+{
+	if (!starting_.erase(StartKey(id, gen, replacement)) || start_queue_.empty()) {
+		return;
+	}
+	for (auto it = start_queue_.begin(); it != start_queue_.end();) {
+		if (max_starting_ > 0 && starting_.size() >= max_starting_) {
+			break;
+		}
+		StartKey key = it->second.key();
+		if (starting_.count(key)) {
+			++it;
+			continue;
+		}
+		starting_.insert(key);
+		admitted_.push_back(it->second.start);
+		it = start_queue_.erase(it);
+	}
+}
+
+// the starts may finish and admit more, run those too, but not recursively
+void DeployWorker::run_admitted()
+{
+	static thread_local bool running = false;
+	if (running) {
+		return;
+	}
+	running = true;
+	for (;;) {
+		std::vector<std::function<void()>> starts;
+		{
+			std::lock_guard<std::mutex> _l(mutex_);
+			starts.swap(admitted_);
+		}
+		if (starts.empty()) {
+			break;
+		}
+		for (auto& start: starts) {
+			start();
+		}
+	}
+	running = false;
+}
+
+void DeployWorker::set_max_starting(size_t n)
+{
+	std::lock_guard<std::mutex> _l(mutex_);
+	max_starting_ = n;
+}
+
+void DeployWorker::set_metrics_socket(const std::string& path)
+{
+	metrics_server_.listen(path);
+}
+
+void DeployWorker::set_control_socket(const std::string& path)
+{
+	control_server_.listen(path);
 }
 
 void DeployWorker::start()
 {
+	// all of them read until EAGAIN
 	poller_.add_fd(fs_watcher_.get_fd(),
-		std::bind(&FileSystemWatcher::on_fd_events, &fs_watcher_, _1, _2));
-	poller_.add_fd(process_watcher_.get_fd(),
-		std::bind(&ProcessWatcher::on_fd_events, &process_watcher_, _1, _2));
-	
-	handler_thread_ = std::thread(std::bind(&DeployWorker::run, this));
+		std::bind(&FileSystemWatcher::on_fd_events, &fs_watcher_, _1, _2), EPOLLIN | EPOLLET);
+	poller_.add_fd(poll_watcher_.get_fd(),
+		std::bind(&PollingWatcher::on_fd_events, &poll_watcher_, _1, _2), EPOLLIN | EPOLLET);
+	if (!process_watcher_.use_pidfd()) {
+		poller_.add_fd(process_watcher_.get_fd(),
+			std::bind(&ProcessWatcher::on_fd_events, &process_watcher_, _1, _2), EPOLLIN | EPOLLET);
+	}
+
+	poller_.add_fd(notify_socket_.get_fd(),
+		std::bind(&NotifySocket::on_fd_events, &notify_socket_, _1, _2), EPOLLIN | EPOLLET);
+	poller_.add_fd(health_checker_.get_fd(),
+		std::bind(&HealthChecker::on_fd_events, &health_checker_, _1, _2), EPOLLIN | EPOLLET);
+	if (metrics_server_.listening()) {
+		poller_.add_fd(metrics_server_.get_fd(),
+			std::bind(&MetricsServer::on_fd_events, &metrics_server_, _1, _2), EPOLLIN | EPOLLET);
+	}
+	if (control_server_.listening()) {
+		poller_.add_fd(control_server_.get_fd(),
+			std::bind(&ControlServer::on_fd_events, &control_server_, _1, _2), EPOLLIN | EPOLLET);
+	}
+
+	if (single_thread_) {
+		// timers and handlers run in the poller thread too
+		poller_.add_fd(scheduler_.get_fd(),
+			std::bind(&FunctionScheduler::on_fd_events, &scheduler_, _1, _2), EPOLLIN | EPOLLET);
+	} else {
+		handler_thread_ = std::thread(std::bind(&DeployWorker::run, this));
+	}
 	poller_thread_ = std::thread(std::bind(&EpollPoller::loop, &poller_));
 	started_ = true;
-	scheduler_.start();
+	if (!single_thread_) {
+		scheduler_.start();
+	}
 }
 
+// set in the handler thread, whose posts can't wait for its own queue
+static thread_local DeployWorker* t_handler = nullptr;
+
 void DeployWorker::run()
 {
-	Function func;
-	while (func = queue_.take()) {
-		func();
+	t_handler = this;
+	// handle all queued tasks per wakeup, an empty task stops the thread
+	std::vector<QueuedTask> batch;
+	for (;;) {
+		if (deferred_.empty()) {
+			queue_.take_all(&batch);
+		} else {
+			queue_.try_take_all(&batch);
+			std::move(deferred_.begin(), deferred_.end(), std::back_inserter(batch));
+			deferred_.clear();
+		}
+		for (auto& queued: batch) {
+			if (!queued.task) {
+				return;
+			}
+			uint64_t now = Metrics::now_us();
+			task_wait_->record(now - std::min(now, queued.queued_us));
+			queued.task();
+		}
+		batch.clear();
+	}
+}
+
+// run `task` in the handler thread, or the poller thread in single thread mode
+void DeployWorker::post(Task task)
+{
+	if (single_thread_) {
+		poller_.post(std::move(task));
+	} else if (t_handler == this) {
+		// `put()` would spin on a full queue only we drain
+		deferred_.push_back(QueuedTask(std::move(task), Metrics::now_us()));
+	} else {
+		queue_.put(QueuedTask(std::move(task), Metrics::now_us()));
 	}
 }
 
 void DeployWorker::stop()
 {
-	Function nop;
-	queue_.put(nop); // stop cb_caller_
+	if (!single_thread_) {
+		queue_.put(QueuedTask()); // stop handler_thread_
+	}
 	poller_.stop(); // stop event_poller_
 	started_ = false;
 }
@@ -105,102 +600,712 @@ void DeployWorker::stop()
 void DeployWorker::ProcessCallback(pid_t pid, const ProcessWatcher::ProcessInfo& info)
 {
 	if (!started_) return;
+	if (health_checker_.on_exit(pid, info.status)) {
+		return;  // a health check command
+	}
 	int status = info.status;
-	printf("EVENT [%d] exit with status %x", pid, status);
 	if (WIFEXITED(status)) {
-		printf(", exit normally, code: %d", WEXITSTATUS(status));
-	}
-	if (WIFSIGNALED(status)) {
-		printf(", terminated by signal: %s, core: %d",
+		LOGI("process %d exited, code: %d", pid, WEXITSTATUS(status));
+	} else if (WIFSIGNALED(status)) {
+		LOGI("process %d terminated by signal: %s, core: %d", pid,
 			strsignal(WTERMSIG(status)), WCOREDUMP(status));
+	} else {
+		LOGI("process %d exited with status %x", pid, status);
 	}
-	if (WIFSTOPPED(status)) {
-		printf(", stoped by signal: %s", strsignal(WSTOPSIG(status)));
-	}
-	if (WIFCONTINUED(status)) {
-		printf(", resumed by SIGCONT");
+	post(std::bind(&DeployWorker::on_child_exit, this, pid, info));
+}
+
+void DeployWorker::PendingChange::add(const char* path, size_t len)
+{
+	// repeated writes to one file come back to back
+	if (spans.size() && spans.back().second == len && arena.compare(spans.back().first, len, path, len) == 0) {
+		return;
 	}
-	printf("\n");
-	queue_.put(std::bind(&DeployWorker::on_child_exit, this, pid, info));
+	spans.push_back(std::make_pair(arena.size(), len));
+	arena.append(path, len);
 }
 
-void DeployWorker::FsEventCallback(std::string path, uint32_t mask)
+void DeployWorker::PendingChange::reset()
 {
-	if (!started_) return;
-	printf("EVENT [%x] on %s with %x\n", mask, path.c_str(), mask);
-	queue_.put(std::bind(&DeployWorker::on_fs_event, this, path, mask));
+	first = last = time_point_t();
+	mask = 0;
+	events = 0;
+	arena.clear();
+	spans.clear();
 }
 
-bool DeployWorker::redeploy(pid_t pid)
+// merged in the watcher thread, the arena only grows for a change set
+// larger than the ones before
+void DeployWorker::FsEventCallback(int id, uint32_t gen, const fsevent::Event& event)
 {
-	std::string path;
-	std::vector<std::string> args;
+	if (!started_ || id < 0) return;
+	LOGD(Logger::Fields().add("path", event.path, event.len), "event [%x]", event.mask);
 
+	bool first = false;
+	long quiet_ms = 0;
+	{
+		std::lock_guard<std::mutex> _l(mutex_);
+		Service* svc = get_service(id, gen);
+		if (!svc) {  // undeployed since
+			return;
+		}
+
+		// merge into the pending change set of this service
+		auto now = std::chrono::steady_clock::now();
+		PendingChange& change = svc->pending;
+		if (!svc->has_pending) {
+			svc->has_pending = true;
+			change.reset();
+			change.first = now;
+			first = true;
+			quiet_ms = svc->policy.quiet_ms;
+		}
+		change.last = now;
+		change.mask |= event.mask;
+		change.events++;
+		change.add(event.path, event.len);
+	}
+
+	if (first) {
+		schedule_flush(id, gen, quiet_ms);
+	}
+}
+
+bool DeployWorker::redeploy(pid_t pid)
+{
 	// clean this process info from the map
+	int id = -1;
 	{
 		std::lock_guard<std::mutex> _l(mutex_);
-		auto it = works_.find(pid);
-		if (it != works_.end()) {
-			args = it->second.args;
-			path = it->second.path;
-			works_.erase(pid);
+		auto it = pids_.find(pid);
+		if (it == pids_.end()) {
+			return false;
 		}
+		id = it->second;
+		pids_.erase(it);
+		services_[id].pid = 0;
+		services_[id].state = DEAD;
 	}
 
 	// schedule a re-deploy work
-	std::string task_name = "redeploy " + path;
-	if (args.size() && !scheduler_.has_schedule(task_name)) {
-		auto ms = std::chrono::milliseconds(next_redeploy_delay() * 1000);
-		printf("schedule a re-deploy task %s...\n", task_name.c_str());
-		scheduler_.schedule(std::bind(&DeployWorker::deploy, this, args, path), ms, task_name);
+	exit_restarts_->add();
+	schedule_restart(id);
+	return true;
+}
+
+bool DeployWorker::restart(const std::string& name)
+{
+	int id;
+	uint32_t gen;
+	pid_t pid;
+	bool start_first;
+	{
+		std::lock_guard<std::mutex> _l(mutex_);
+		auto it = names_.find(name);
+		if (it == names_.end()) {
+			return false;
+		}
+		id = it->second;
+		gen = services_[id].gen;
+		pid = services_[id].pid;
+		start_first = services_[id].policy.strategy == Policy::START_FIRST;
+	}
+	if (pid == 0) {
+		return true;  // the scheduled restart is as good
+	}
+	request_restarts_->add();
+	if (start_first) {
+		request_start(id, gen, true, std::bind(&DeployWorker::start_replacement, this, id, gen));
+	} else {
+		request_start(id, gen, false, std::bind(&DeployWorker::stop_for_restart, this, id, gen));
+	}
+	return true;
+}
+
+// restart the service after its backoff delay
+void DeployWorker::schedule_restart(int id)
+{
+	std::lock_guard<std::mutex> _l(mutex_);
+	Service& svc = services_[id];
+	std::string task_name = "redeploy " + svc.name;
+	if (!svc.active || scheduler_.has_schedule(task_name)) {
+		return;
+	}
+	uint32_t gen = svc.gen;
+	long ms = next_restart_delay(svc);
+	LOGI("schedule a re-deploy task %s after %ldms...", task_name.c_str(), ms);
+	scheduler_.schedule([this, id, gen]() {
+		post(std::bind(&DeployWorker::request_start, this, id, gen, false,
+			std::function<void()>(std::bind(&DeployWorker::restart_service, this, id, gen))));
+	}, std::chrono::milliseconds(ms), task_name);
+}
+
+void DeployWorker::restart_service(int id, uint32_t gen)
+{
+	AdmittedStarts _starts(this);
+	{
+		std::lock_guard<std::mutex> _l(mutex_);
+		Service* svc = get_service(id, gen);
+		if (!svc) {
+			return;
+		}
+		if (svc->pid != 0) {
+			finish_start(id, gen, false);
+			return;
+		}
+		if (spawn(id) > 0) {
+			return;
+		}
+		finish_start(id, gen, false);
 	}
+	// exec failed, try again later
+	schedule_restart(id);
 }
 
 void DeployWorker::on_child_exit(pid_t pid, const ProcessWatcher::ProcessInfo& info)
 {
-	printf("child %d exited, restart it after %lds...\n", pid, redeploy_interval_.load());
+	AdmittedStarts _starts(this);
+	long timeout_ms;
+	{
+		std::lock_guard<std::mutex> _l(mutex_);
+		auto it = pids_.find(pid);
+		if (it == pids_.end()) {
+			return;  // killed on purpose
+		}
+		int id = it->second;
+		Service& svc = services_[id];
+		if (pid == svc.next_pid) {
+			LOGW(Logger::Fields().add("service", svc.name).add("pid", pid), "replacement died before ready, keep %d", svc.pid);
+			svc.next_pid = 0;
+			pids_.erase(it);
+			finish_start(id, svc.gen, true);
+			stop_process(pid, svc.policy.stop_timeout_ms);
+			return;
+		}
+		if (pid == svc.pid && svc.state == STOPPING) {
+			// stopped for a restart, `on_stopped()` starts the new one
+			pids_.erase(it);
+			svc.pid = 0;
+			return;
+		}
+		if (pid == svc.pid && svc.state == STARTING) {
+			finish_start(id, svc.gen, false);
+		}
+		timeout_ms = svc.policy.stop_timeout_ms;
+		if (svc.output) {
+			log_tail(svc.name, svc.output->tail());
+		}
+	}
+
+	// don't leave its children behind, they may hold the ports, restart
+	// once they're gone, unless restarted or released meanwhile
+	stop_process(pid, timeout_ms, std::bind(&DeployWorker::redeploy, this, pid));
+}
+
+void DeployWorker::schedule_flush(int id, uint32_t gen, long ms)
+{
+	scheduler_.schedule([this, id, gen]() {
+		post(std::bind(&DeployWorker::flush_changes, this, id, gen));
+	}, std::chrono::milliseconds(ms));
+}
+
+// restart the service once its tree is quiet, or the latency cap is hit
+void DeployWorker::flush_changes(int id, uint32_t gen)
+{
+	using namespace std::chrono;
+
+	long delay = 0;
+	pid_t pid = 0;
+	bool start_first = false;
+	std::string name;
+	std::vector<std::string> paths;
+	{
+		std::lock_guard<std::mutex> _l(mutex_);
+		Service* svc = get_service(id, gen);
+		if (!svc || !svc->has_pending) {
+			return;
+		}
+		PendingChange& change = svc->pending;
+		const Policy& policy = svc->policy;
+		pid = svc->pid;
+		name = svc->name;
+		start_first = policy.strategy == Policy::START_FIRST;
+
+		auto now = steady_clock::now();
+		auto quiet_left = change.last + milliseconds(policy.quiet_ms) - now;
+		auto cap_left = change.first + milliseconds(policy.max_latency_ms) - now;
+		if (quiet_left.count() > 0 && cap_left.count() > 0) {
+			delay = duration_cast<milliseconds>(std::min(quiet_left, cap_left)).count() + 1;
+		} else {
+			// dedup the paths in place, in the arena
+			const std::string& arena = change.arena;
+			auto& spans = change.spans;
+			std::sort(spans.begin(), spans.end(), [&](const std::pair<size_t, size_t>& a, const std::pair<size_t, size_t>& b) {
+				return arena.compare(a.first, a.second, arena, b.first, b.second) < 0;
+			});
+			spans.erase(std::unique(spans.begin(), spans.end(), [&](const std::pair<size_t, size_t>& a, const std::pair<size_t, size_t>& b) {
+				return arena.compare(a.first, a.second, arena, b.first, b.second) == 0;
+			}), spans.end());
+			LOGI(Logger::Fields().add("service", name), "%zu events on %zu files in %ldms", change.events,
+				spans.size(), (long) duration_cast<milliseconds>(now - change.first).count());
+			if (policy.content_hash) {
+				for (auto& span: spans) {
+					paths.push_back(arena.substr(span.first, span.second));
+				}
+			}
+			svc->has_pending = false;
+			change.reset();
+		}
+	}
+
+	if (delay > 0) {  // not quiet yet
+		schedule_flush(id, gen, delay);
+		return;
+	}
+
+	// drop the change set if no content changed, `touch` or identical rewrites,
+	// since this service last looked, other services may have seen it first
+	if (paths.size()) {
+		std::vector<uint64_t> seqs;
+		for (auto& path: paths) {
+			seqs.push_back(content_index_.update(path));
+		}
+		bool changed = false;
+		{
+			std::lock_guard<std::mutex> _l(mutex_);
+			Service* svc = get_service(id, gen);
+			if (!svc) {
+				return;
+			}
+			for (size_t i = 0; i < paths.size(); i++) {
+				auto it = svc->content_seen.find(paths[i]);
+				uint64_t seen = it != svc->content_seen.end() ? it->second : svc->content_seq;
+				if (seqs[i] > seen) {
+					svc->content_seen[paths[i]] = seqs[i];
+					changed = true;
+				}
+			}
+		}
+		if (!changed) {
+			LOGI(Logger::Fields().add("service", name), "content not changed, skip restart");
+			return;
+		}
+	}
+
+	if (start_first || pid > 0) {
+		change_restarts_->add();
+	}
+	if (start_first) {
+		request_start(id, gen, true, std::bind(&DeployWorker::start_replacement, this, id, gen));
+	} else if (pid > 0) {
+		request_start(id, gen, false, std::bind(&DeployWorker::stop_for_restart, this, id, gen));
+	}
+}
+
+// stop-first restart: the new process is spawned once the old group is gone
+void DeployWorker::stop_for_restart(int id, uint32_t gen)
+{
+	AdmittedStarts _starts(this);
+	pid_t pid;
+	long timeout_ms;
+	{
+		std::lock_guard<std::mutex> _l(mutex_);
+		Service* svc = get_service(id, gen);
+		if (!svc) {
+			return;
+		}
+		if (svc->pid == 0) {  // the pending restart runs the new code
+			finish_start(id, gen, false);
+			return;
+		}
+		pid = svc->pid;
+		svc->state = STOPPING;
+		timeout_ms = svc->policy.stop_timeout_ms;
+		LOGI(Logger::Fields().add("service", svc->name).add("pid", pid), "un-deploy process...");
+	}
+
+	// keep the watch, the tree walk is not needed for a restart
+	stop_process(pid, timeout_ms, std::bind(&DeployWorker::on_stopped, this, id, gen, pid));
+}
+
+// blue/green restart: spawn the new process beside the old one,
+// the old one is killed in `on_ready()` once the new one is ready.
+void DeployWorker::start_replacement(int id, uint32_t gen)
+{
+	AdmittedStarts _starts(this);
+	{
+		std::lock_guard<std::mutex> _l(mutex_);
+		Service* svc = get_service(id, gen);
+		if (!svc) {
+			return;
+		}
+		if (svc->pid == 0) {  // not running, the scheduled restart runs the new code
+			finish_start(id, gen, true);
+			return;
+		}
+		if (svc->next_pid > 0) {  // superseded by this change
+			pids_.erase(svc->next_pid);
+			stop_process(svc->next_pid, svc->policy.stop_timeout_ms);
+			svc->next_pid = 0;
+		}
+		pid_t pid = spawn(id, true);
+		if (pid > 0) {
+			LOGI(Logger::Fields().add("service", svc->name).add("pid", pid), "replacement started, old %d", svc->pid);
+		} else {  // keep the old one
+			finish_start(id, gen, true);
+		}
+	}
+}
+
+void DeployWorker::on_ready(int id, uint32_t gen, pid_t pid)
+{
+	AdmittedStarts _starts(this);
+	using namespace std::chrono;
+
+	pid_t old = 0;
+	long timeout_ms;
+	{
+		std::lock_guard<std::mutex> _l(mutex_);
+		Service* svc = get_service(id, gen);
+		if (!svc) {
+			return;
+		}
+		if (pid == svc->next_pid) {
+			old = svc->pid;
+			svc->pid = pid;
+			svc->started = svc->next_started;
+			svc->next_pid = 0;
+			if (old > 0) {
+				pids_.erase(old);  // its exit won't trigger a restart
+			}
+			finish_start(id, gen, true);
+		} else if (pid == svc->pid && svc->state == STARTING) {
+			finish_start(id, gen, false);
+		} else {
+			return;  // died, or superseded
+		}
+		svc->state = READY;
+		if (svc->health) {
+			health_checker_.reset(svc->health);
+		}
+		timeout_ms = svc->policy.stop_timeout_ms;
+		auto took = steady_clock::now() - svc->started;
+		ready_time_->record(duration_cast<microseconds>(took).count());
+		LOGI(Logger::Fields().add("service", svc->name).add("pid", pid), "process ready in %ldms",
+			(long) duration_cast<milliseconds>(took).count());
+	}
+
+	if (old > 0) {
+		LOGI("drain old process %d", old);
+		stop_process(old, timeout_ms);
+	}
+}
+
+void DeployWorker::on_start_timeout(int id, uint32_t gen, pid_t pid)
+{
+	AdmittedStarts _starts(this);
+	long timeout_ms;
+	{
+		std::lock_guard<std::mutex> _l(mutex_);
+		Service* svc = get_service(id, gen);
+		if (!svc) {
+			return;
+		}
+		if (pid == svc->next_pid) {  // keep the old one
+			svc->next_pid = 0;
+			pids_.erase(pid);
+			finish_start(id, gen, true);
+		} else if (pid != svc->pid || svc->state != STARTING) {
+			return;
+		}
+		// the exit of `pid` as the main process schedules a restart
+		LOGW(Logger::Fields().add("service", svc->name).add("pid", pid), "process not ready in %ldms", svc->policy.start_timeout_ms);
+		timeout_ms = svc->policy.stop_timeout_ms;
+	}
+	stop_process(pid, timeout_ms);
+}
+
+// failed its health check too many times in a row, the exit of the
+// process schedules a restart, and the probe is paused until the next
+// process is ready so it isn't stopped again meanwhile
+void DeployWorker::on_unhealthy(int id, uint32_t gen, std::string reason)
+{
+	pid_t pid;
+	long timeout_ms;
+	{
+		std::lock_guard<std::mutex> _l(mutex_);
+		Service* svc = get_service(id, gen);
+		if (!svc || svc->pid == 0 || svc->state != READY) {
+			return;  // not up yet, or already going
+		}
+		pid = svc->pid;
+		LOGW(Logger::Fields().add("service", svc->name).add("pid", pid), "process unhealthy, %d checks failed, last: %s",
+			svc->policy.health_failures, reason.c_str());
+		timeout_ms = svc->policy.stop_timeout_ms;
+		health_checker_.pause(svc->health);
+	}
+	unhealthy_->add();
+	stop_process(pid, timeout_ms);
+}
 
-	redeploy(pid);
+// SIGTERM the process group of `pid`, SIGKILL it if still alive after
+// `timeout_ms`, and run `done` in the handler thread once it's gone.
+void DeployWorker::stop_process(pid_t pid, long timeout_ms, std::function<void()> done)
+{
+	process_watcher_.kill_group(pid, SIGTERM);
+	wait_stopped(pid, std::chrono::steady_clock::now(), timeout_ms, false, done);
 }
 
-void DeployWorker::on_fs_event(std::string path, uint32_t mask)
+void DeployWorker::wait_stopped(pid_t pid, time_point_t since, long timeout_ms, bool killed, std::function<void()> done)
 {
-	printf("file %s updated, works_.size(): %zu...\n", path.c_str(), works_.size());
+	using namespace std::chrono;
 
-	std::vector<pid_t> pids;
+	long elapsed = duration_cast<milliseconds>(steady_clock::now() - since).count();
+	bool alive = process_watcher_.group_alive(pid);
+	if (alive && killed && elapsed >= 2 * timeout_ms) {
+		// zombies left to an init which doesn't reap, or stuck in the kernel
+		LOGW("process group %d still exists after SIGKILL, give up", pid);
+		alive = false;
+	}
+	if (!alive) {
+		stop_time_->record(duration_cast<microseconds>(steady_clock::now() - since).count());
+		LOGI("process group %d gone in %ldms", pid, elapsed);
+		if (done) {
+			post(done);
+		}
+		return;
+	}
+	if (!killed && timeout_ms > 0 && elapsed >= timeout_ms) {
+		LOGW("process group %d not stopped in %ldms, killed", pid, elapsed);
+		process_watcher_.kill_group(pid, SIGKILL);
+		killed = true;
+	}
+	scheduler_.schedule(std::bind(&DeployWorker::wait_stopped, this, pid, since, timeout_ms, killed, done),
+		milliseconds(kStopPollInterval));
+}
+
+// the group of a process stopped for a restart is gone, start the new one
+void DeployWorker::on_stopped(int id, uint32_t gen, pid_t pid)
+{
+	AdmittedStarts _starts(this);
+	bool failed = false;
 	{
 		std::lock_guard<std::mutex> _l(mutex_);
-		for (auto e: works_) {
-			auto work = e.second;
-			printf("compare(%s, %s)\n", work.path.c_str(), path.c_str());
-			if (work.path == path) {
-				pids.push_back(work.pid);
+		Service* svc = get_service(id, gen);
+		if (!svc) {
+			return;
+		}
+		if (svc->state != STOPPING || (svc->pid != pid && svc->pid != 0)) {
+			finish_start(id, gen, false);
+			return;
+		}
+		pids_.erase(pid);  // may be reaped but not handled yet
+		svc->pid = 0;
+		svc->state = DEAD;
+		failed = spawn(id) < 0;
+		if (failed) {
+			finish_start(id, gen, false);
+		}
+	}
+	if (failed) {
+		schedule_restart(id);
+	}
+}
+
+void DeployWorker::NotifyCallback(pid_t pid, std::string message)
+{
+	if (!started_) return;
+	post(std::bind(&DeployWorker::on_notify, this, pid, std::move(message)));
+}
+
+// sd_notify messages, newline separated assignments
+void DeployWorker::on_notify(pid_t pid, std::string message)
+{
+	int id;
+	uint32_t gen;
+	{
+		std::lock_guard<std::mutex> _l(mutex_);
+		auto it = pids_.find(pid);
+		if (it == pids_.end()) {
+			return;  // only the main process of a service may notify
+		}
+		id = it->second;
+		gen = services_[id].gen;
+	}
+
+	for (auto& line: split_lines(message)) {
+		if (line == "READY=1") {
+			on_ready(id, gen, pid);
+		} else if (line.compare(0, 7, "STATUS=") == 0) {
+			LOGI("process %d status: %s", pid, line.c_str() + 7);
+		}
+	}
+}
+
+void DeployWorker::ControlCallback(const std::string& line, ControlServer::Reply reply)
+{
+	post(std::bind(&DeployWorker::on_control, this, line, std::move(reply)));
+}
+
+void DeployWorker::on_control(std::string line, ControlServer::Reply reply)
+{
+	std::string answer;
+	try {
+		answer = control(line);
+	} catch (const std::exception& e) {
+		answer = std::string("error ") + e.what();
+	}
+	reply(std::move(answer));
+}
+
+// requests by service name, answered by "ok ..." or "error <why>":
+//
+//     deploy <name> key=value ...  options of a services file, quote a
+//                                  value with spaces: cmd="./server -p 80";
+//                                  the same again is a no-op, other
+//                                  options replace the running service
+//     undeploy <name>              no-op if not deployed
+//     restart <name>
+//     status <name>                state, pid and uptime
+//     tail <name>                  last output, if logged to a file, with
+//                                  `\n` for newlines and `\\` for `\`
+//     list                         count and names
+std::string DeployWorker::control(const std::string& line)
+{
+	AdmittedStarts _starts(this);
+	using namespace std::chrono;
+
+	std::vector<std::string> args = ServiceConfig::split_args(line);
+	if (args.empty()) {
+		return "error empty request";
+	}
+	const std::string& op = args[0];
+	if (op == "list") {
+		std::lock_guard<std::mutex> _l(mutex_);
+		std::string answer = "ok " + std::to_string(names_.size());
+		for (auto& kv: names_) {
+			answer += " " + kv.first;
+		}
+		return answer;
+	}
+	if (op != "deploy" && op != "undeploy" && op != "restart" && op != "status" && op != "tail") {
+		return "error unknown request: " + op;
+	}
+	if (args.size() < 2) {
+		return "error usage: " + op + " <name>";
+	}
+	const std::string& name = args[1];
+
+	if (op == "undeploy") {
+		return undeploy(name) ? "ok removed" : "ok absent";
+	}
+	if (op == "restart") {
+		return restart(name) ? "ok restarting" : "error no service " + name;
+	}
+	if (op == "tail") {
+		{
+			std::lock_guard<std::mutex> _l(mutex_);
+			if (names_.find(name) == names_.end()) {
+				return "error no service " + name;
 			}
 		}
+		// one line per answer
+		std::string answer = "ok ";
+		for (char c: tail(name)) {
+			if (c == '\n') {
+				answer += "\\n";
+			} else if (c == '\\') {
+				answer += "\\\\";
+			} else {
+				answer += c;
+			}
+		}
+		return answer;
+	}
+	if (op == "status") {
+		std::lock_guard<std::mutex> _l(mutex_);
+		auto it = names_.find(name);
+		if (it == names_.end()) {
+			return "error no service " + name;
+		}
+		const Service& svc = services_[it->second];
+		std::string answer = std::string("ok ") + state_name(svc.state) + " pid=" + std::to_string(svc.pid);
+		if (svc.pid > 0) {
+			answer += " uptime_ms=" + std::to_string(duration_cast<milliseconds>(steady_clock::now() - svc.started).count());
+		}
+		if (svc.next_pid > 0) {
+			answer += " next_pid=" + std::to_string(svc.next_pid);
+		}
+		return answer;
 	}
 
-	for (auto pid: pids) {
-		printf("  %s: un-deploy process %d...\n", path.c_str(), pid);
-		undeloy(pid);
-		reset_redeploy_delay();
-		printf("redeploy_interval_: %ld\n", redeploy_interval_.load());
-		redeploy(pid);
+	// deploy
+	ServiceSpec spec;
+	spec.name = name;
+	std::string options;
+	for (size_t i = 2; i < args.size(); i++) {
+		size_t eq = args[i].find('=');
+		if (eq == std::string::npos) {
+			return "error bad option: " + args[i];
+		}
+		ServiceConfig::set_option(&spec, args[i].substr(0, eq), args[i].substr(eq + 1));
+		options += args[i] + "\n";
+	}
+	if (spec.args.empty()) {
+		return "error cmd is required";
 	}
+	bool replaced = false;
+	{
+		std::lock_guard<std::mutex> _l(mutex_);
+		auto it = names_.find(name);
+		if (it != names_.end()) {
+			Service& svc = services_[it->second];
+			if (svc.options == options) {
+				return "ok unchanged " + std::to_string(svc.pid);
+			}
+			LOGI(Logger::Fields().add("service", name), "options changed, replace it");
+			replaced = true;
+		}
+	}
+	// the old one keeps running if the new spec fails
+	pid_t pid = deploy(spec, true);
+	{
+		std::lock_guard<std::mutex> _l(mutex_);
+		auto it = names_.find(name);
+		if (it != names_.end()) {
+			services_[it->second].options = options;
+		}
+	}
+	return (replaced ? "ok replaced " : "ok deployed ") + std::to_string(pid);
 }
 
-long DeployWorker::next_redeploy_delay()
+const char* DeployWorker::state_name(State state)
 {
-	long current = redeploy_interval_;
-	long twice = current * 2;
-	printf("next redeploy delay: %ld\n", redeploy_interval_.load());
-	if (redeploy_interval_.compare_exchange_strong(current, twice)
-		&& redeploy_interval_ > kMaxRedeployInterval) {
-		redeploy_interval_ = 1;
+	switch (state) {
+	case DEAD: return "dead";
+	case STARTING: return "starting";
+	case READY: return "ready";
+	case STOPPING: return "stopping";
 	}
-	return current;
+	return "unknown";
 }
 
-void DeployWorker::reset_redeploy_delay()
+// decorrelated jitter: random in [min, 3 * last delay], capped by max,
+// start over from min once the process stayed up for `reset_after_ms`.
+long DeployWorker::next_restart_delay(Service& svc)
 {
-	redeploy_interval_ = 1;
+	using namespace std::chrono;
+
+	const Policy& policy = svc.policy;
+	long uptime = duration_cast<milliseconds>(steady_clock::now() - svc.started).count();
+	if (uptime >= policy.reset_after_ms) {
+		svc.backoff_ms = 0;
+	}
+	long low = std::max(1L, policy.backoff_min_ms);
+	long high = std::min(policy.backoff_max_ms, std::max(low, svc.backoff_ms) * 3);
+	if (high < low) {
+		high = low;
+	}
+	svc.backoff_ms = std::uniform_int_distribution<long>(low, high)(random_);
+	return svc.backoff_ms;
 }
@@ -2,70 +2,243 @@
 #define _DEPLOY_WORKER_H_
 
 #include "EpollPoller.h"
-#include "BlockingQueue.h"
+#include "MpscQueue.h"
+#include "Task.h"
 #include "ProcessWatcher.h"
 #include "FileSystemWatcher.h"
+#include "PollingWatcher.h"
 #include "FunctionScheduler.h"
-
+#include "ContentIndex.h"
+#include "ServiceConfig.h"
+#include "NotifySocket.h"
+#include "OutputLog.h"
+#include "Metrics.h"
+#include "MetricsServer.h"
+#include "HealthChecker.h"
+#include "ControlServer.h"
+
+#include <set>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <tuple>
+#include <functional>
 #include <thread>
 #include <vector>
 #include <string>
+#include <unordered_map>
 
 class DeployWorker
 {
 public:
-	DeployWorker();
+	typedef ServicePolicy Policy;
+	typedef std::chrono::steady_clock::time_point time_point_t;
+
+	// `single_thread`: run handlers and timers in the poller thread,
+	// instead of a handler thread and a scheduler thread.
+	explicit DeployWorker(bool single_thread = false);
 
 	~DeployWorker();
 
 	void start();
 
-	pid_t deploy(std::vector<std::string> args, std::string path);
+	// at most `n` restarts in progress at a time, 0 for unlimited
+	void set_max_starting(size_t n);
+
+	// serve the metrics on a unix socket, "@name" for the abstract
+	// namespace, call before `start()`
+	void set_metrics_socket(const std::string& path);
+
+	// serve the control protocol, see `control()`, on a unix socket,
+	// call before `start()`
+	void set_control_socket(const std::string& path);
+
+	// deploy a service, return pid of its first process, with `replace` a
+	// service of the same name is released once the new one is set up
+	pid_t deploy(ServiceSpec spec, bool replace = false);
+
+	pid_t deploy(std::vector<std::string> args, std::string path, Policy policy = Policy());
+
+	bool undeploy(std::string name);
 
 	bool undeloy(pid_t pid);
 
+	// the last output of a service with a log file, empty if none
+	std::string tail(const std::string& name);
+
 	bool redeploy(pid_t pid);
 
+	// restart a service the way a change does, false if no such service
+	bool restart(const std::string& name);
+
+	// run a request of the control protocol, return its answer
+	std::string control(const std::string& line);
+
 	void stop();
 
 protected:
 
 	void run();
-	long next_redeploy_delay();
-	void reset_redeploy_delay();
+	void post(Task task);
 
 	void ProcessCallback(pid_t pid, const ProcessWatcher::ProcessInfo& info);
 	void on_child_exit(pid_t pid, const ProcessWatcher::ProcessInfo& info);
 
-	void FsEventCallback(std::string path, uint32_t mask);
-	void on_fs_event(std::string path, uint32_t mask);
+	void FsEventCallback(int id, uint32_t gen, const fsevent::Event& event);
+	void schedule_flush(int id, uint32_t gen, long ms);
+	void flush_changes(int id, uint32_t gen);
+
+	void schedule_restart(int id);
+	void restart_service(int id, uint32_t gen);
+
+	void request_start(int id, uint32_t gen, bool replacement, std::function<void()> start);
+
+	void stop_for_restart(int id, uint32_t gen);
+	void start_replacement(int id, uint32_t gen);
+	void on_ready(int id, uint32_t gen, pid_t pid);
+	void on_start_timeout(int id, uint32_t gen, pid_t pid);
+	void on_unhealthy(int id, uint32_t gen, std::string reason);
+	void stop_process(pid_t pid, long timeout_ms, std::function<void()> done = nullptr);
+	void wait_stopped(pid_t pid, time_point_t since, long timeout_ms, bool killed, std::function<void()> done);
+	void on_stopped(int id, uint32_t gen, pid_t pid);
+
+	void NotifyCallback(pid_t pid, std::string message);
+	void on_notify(pid_t pid, std::string message);
+
+	void ControlCallback(const std::string& line, ControlServer::Reply reply);
+	void on_control(std::string line, ControlServer::Reply reply);
 
 private:
-	typedef std::function<void(void)> Function;
-	struct Work {
-		pid_t pid;
-		std::string path;
-		std::vector<std::string> args;
-
-		Work() : pid(0), path(), args() {}
-		Work(pid_t pi, const std::string& pa, const std::vector<std::string>& a) : pid(pi), path(pa), args(a) {}
-		Work(const Work&) = default;
+	// fs events of one service waiting for the quiet period, the paths are
+	// kept in an arena reused across change sets, deduplicated on flush
+	struct PendingChange {
+		time_point_t first;
+		time_point_t last;
+		uint32_t mask;
+		size_t events;
+		std::string arena;  // event paths, back to back
+		std::vector<std::pair<size_t, size_t>> spans;  // (offset, length) in `arena`
+
+		PendingChange() : first(), last(), mask(0), events(0), arena(), spans() {}
+
+		void add(const char* path, size_t len);
+
+		// keeps the capacity
+		void reset();
+	};
+
+	enum State {
+		DEAD,      // no process, a restart is scheduled
+		STARTING,  // spawned, not ready yet
+		READY,
+		STOPPING,  // SIGTERM sent for a restart, respawn once its group is gone
 	};
 
+	static const char* state_name(State state);
+
+	// one per deployed service, slots of `services_` are reused, and
+	// `gen` is bumped on reuse, so a late task can't hit another service.
+	struct Service {
+		uint32_t gen;
+		bool active;
+		pid_t pid;       // 0 if not running
+		State state;     // of `pid`
+		time_point_t started;
+		pid_t next_pid;  // replacement not ready yet, START_FIRST only
+		time_point_t next_started;
+		long backoff_ms;  // last restart delay, 0 if reset
+		std::string name;
+		ProcessWatcher::Command cmd;  // built once per service
+		std::vector<std::string> paths;
+		std::vector<std::pair<WatchBackend*, int>> watches;  // subscriptions per path
+		std::vector<int> listen_fds;  // kept open across restarts
+		std::shared_ptr<OutputLog> output;  // stdout and stderr, if captured
+		int health;  // handle of the health check, 0 if none
+		std::string options;  // of the control request deploying it, to tell a repeated one
+		Policy policy;
+		bool has_pending;
+		PendingChange pending;
+		uint64_t content_seq;  // of the content index when deployed
+		std::unordered_map<std::string, uint64_t> content_seen;  // path -> last change acted on
+
+		Service() : gen(0), active(false), pid(0), state(DEAD), started(),
+			next_pid(0), next_started(), backoff_ms(0), name(), cmd(), paths(), watches(), listen_fds(),
+			output(), health(0), options(), policy(), has_pending(false), pending(),
+			content_seq(0), content_seen() {}
+	};
+
+	// a start in progress, of the main process or a replacement
+	typedef std::tuple<int, uint32_t, bool> StartKey;
+	typedef std::pair<int, uint64_t> StartOrder;  // (-priority, seq)
+
+	struct PendingStart {
+		int id;
+		uint32_t gen;
+		bool replacement;
+		std::function<void()> start;
+
+		StartKey key() const { return StartKey(id, gen, replacement); }
+	};
+
+	// runs the starts admitted by `finish_start()` once out of scope,
+	// declared before any lock guard so `mutex_` is released by then
+	struct AdmittedStarts {
+		DeployWorker* worker;
+		explicit AdmittedStarts(DeployWorker* w) : worker(w) {}
+		~AdmittedStarts() { worker->run_admitted(); }
+	};
+
+	void run_admitted();
+
+	// all with `mutex_` held
+	Service* get_service(int id, uint32_t gen);
+	void finish_start(int id, uint32_t gen, bool replacement);
+	pid_t spawn(int id, bool replacement = false);
+	long next_restart_delay(Service& svc);
+	void release_service(int id);
+
 private:
-	BlockingQueue<Function> queue_;
+	bool single_thread_;
+	Metrics metrics_;  // first, the others record to it
+	MpscQueue<QueuedTask> queue_;
+	std::vector<QueuedTask> deferred_;  // posted by the handler thread itself
+	EpollPoller poller_;  // before the watchers, which register fds to it
 	FunctionScheduler scheduler_;
 	FileSystemWatcher fs_watcher_;
+	PollingWatcher poll_watcher_;  // for paths inotify may miss changes of
 	ProcessWatcher process_watcher_;
-	EpollPoller poller_;
+	ContentIndex content_index_;
+	NotifySocket notify_socket_;
+	MetricsServer metrics_server_;
+	HealthChecker health_checker_;
+	ControlServer control_server_;
 	std::thread handler_thread_;
 	std::thread poller_thread_;
 
 	std::mutex mutex_;
-	std::map<pid_t, Work> works_;
+	std::vector<Service> services_;
+	std::vector<int> free_ids_;
+	std::unordered_map<pid_t, int> pids_;    // running pid -> service id
+	std::map<std::string, int> names_;       // service name -> service id
 
 	std::atomic<bool> started_{false};
-	std::atomic<long> redeploy_interval_{1};
+	std::mt19937 random_;  // under `mutex_`
+
+	size_t max_starting_;
+	std::set<StartKey> starting_;
+	std::map<StartOrder, PendingStart> start_queue_;
+	std::vector<std::function<void()>> admitted_;  // to run without `mutex_`
+	uint64_t start_seq_;
+
+	Metrics::Histogram* task_wait_;
+	Metrics::Counter* change_restarts_;
+	Metrics::Counter* exit_restarts_;
+	Metrics::Counter* request_restarts_;
+	Metrics::Histogram* ready_time_;
+	Metrics::Histogram* stop_time_;
+	Metrics::Counter* unhealthy_;
 };
 
-#endif  // _DEPLOY_WORKER_H_
\ No newline at end of file
+#endif  // _DEPLOY_WORKER_H_
@@ -2,57 +2,154 @@
 #include "RuntimeError.h"
 
 #include <vector>
+#include <algorithm>
 #include <unistd.h>
-#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
-EpollPoller::EpollPoller()
+using namespace std::placeholders;
+
+EpollPoller::EpollPoller(Metrics* metrics)
+	: pending_(4096)
 {
+	if (!metrics) {
+		metrics = Metrics::none();
+	}
+	wakeups_ = metrics->counter("autodeploy_poller_wakeups_total", "Returns of epoll_wait.");
+	events_ = metrics->counter("autodeploy_poller_events_total", "Fd events dispatched.");
+	task_wait_ = metrics->histogram("autodeploy_task_wait_seconds{queue=\"poller\"}",
+		"Time from posting a task to running it.");
+	metrics->gauge("autodeploy_pending_tasks{queue=\"poller\"}", "Tasks posted, not run yet.",
+		[this] { return (double) pending_.size(); });
+
 	epfd_ = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd_ < 0) {
+		throw RuntimeError("epoll_create1 failed");
+	}
+	wakeup_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakeup_fd_ < 0) {
+		throw RuntimeError("eventfd failed");
+	}
+	add_fd(wakeup_fd_, std::bind(&EpollPoller::on_wakeup, this, _1, _2));
 }
 
 EpollPoller::~EpollPoller()
 {
+	for (auto h: handlers_) {
+		delete h;
+	}
+	for (auto h: retired_) {
+		delete h;
+	}
+	if (wakeup_fd_ >= 0) {
+		close(wakeup_fd_);
+	}
 	if (epfd_ >= 0) {
 		close(epfd_);
 	}
 }
 
+void EpollPoller::post(Task task)
+{
+	QueuedTask queued(std::move(task), Metrics::now_us());
+	if (!pending_.try_put(std::move(queued))) {
+		// the loop thread may be the poster, so never wait for room
+		std::lock_guard<std::mutex> _l(mutex_);
+		overflow_.push_back(std::move(queued));
+		overflowed_ = true;
+	}
+	if (!wakeup_pending_.exchange(true)) {
+		uint64_t one = 1;
+		if (write(wakeup_fd_, &one, sizeof(one)) < 0) {
+			throw RuntimeError("write eventfd failed");
+		}
+	}
+}
+
+void EpollPoller::on_wakeup(int fd, short events)
+{
+	uint64_t count;
+	if (read(wakeup_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		throw RuntimeError("read eventfd failed");
+	}
+
+	// clear before draining, a post() after the drain writes the eventfd again
+	wakeup_pending_ = false;
+	pending_.try_take_all(&batch_);
+	if (overflowed_.exchange(false)) {
+		std::lock_guard<std::mutex> _l(mutex_);
+		for (auto& queued: overflow_) {
+			batch_.push_back(std::move(queued));
+		}
+		overflow_.clear();
+	}
+	for (auto& queued: batch_) {
+		uint64_t now = Metrics::now_us();
+		task_wait_->record(now - std::min(now, queued.queued_us));
+		queued.task();
+	}
+	batch_.clear();
+}
+
 void EpollPoller::stop()
 {
 	stop_ = true;
+	post(Task([] {}));  // wake up the loop
 }
 
 void EpollPoller::loop()
 {
 	std::vector<struct epoll_event> events(256);
 	while (!stop_) {
-		// printf("waiting ready events...\n");
-		int nready = epoll_wait(epfd_, &events[0], events.size(), 1000);
-		// printf("nready: %d\n", nready);
+		int nready = epoll_wait(epfd_, &events[0], events.size(), -1);
 		if (nready < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
 			throw RuntimeError("epoll_wait failed");
 		}
+		wakeups_->add();
+		events_->add(nready);
 		for (int i = 0; i < nready; i++) {
-			int fd = events[i].data.fd;
-			auto cb = get_cb(fd);
-			if (cb) {
-				cb(fd, events[i].events);
+			auto h = static_cast<Handler*>(events[i].data.ptr);
+			if (h->active.load(std::memory_order_acquire)) {
+				h->cb(h->fd, events[i].events);
 			}
 		}
+		if (has_retired_) {
+			free_retired();
+		}
 	}
 }
 
-void EpollPoller::add_fd(int fd, Callback cb)
+void EpollPoller::add_fd(int fd, Callback cb, uint32_t events)
 {
+	Handler* h = new Handler(fd, cb);
+	{
+		std::lock_guard<std::mutex> _l(mutex_);
+		if (fd >= (int) handlers_.size()) {
+			handlers_.resize(fd + 1, nullptr);
+		}
+		if (handlers_[fd]) {
+			delete h;
+			errno = EEXIST;
+			throw RuntimeError("EPOLL_CTL_ADD failed");
+		}
+		handlers_[fd] = h;
+	}
+
 	struct epoll_event event;
-	event.events = EPOLLIN | EPOLLOUT;
-	event.data.fd = fd;
+	event.events = events;
+	event.data.ptr = h;
 	if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &event) < 0) {
+		int err = errno;
+		{
+			std::lock_guard<std::mutex> _l(mutex_);
+			handlers_[fd] = nullptr;
+		}
+		delete h;
+		errno = err;
 		throw RuntimeError("EPOLL_CTL_ADD failed");
 	}
-
-	std::lock_guard<std::mutex> _l(mutex_);
-	cbs_[fd] = cb;
 }
 
 void EpollPoller::remove_fd(int fd)
@@ -61,15 +158,30 @@ void EpollPoller::remove_fd(int fd)
 		throw RuntimeError("EPOLL_CTL_DEL failed");
 	}
 	std::lock_guard<std::mutex> _l(mutex_);
-	cbs_.erase(fd);
+	if (fd < (int) handlers_.size() && handlers_[fd]) {
+		// may be in the batch the loop is handling, free it after that
+		handlers_[fd]->active.store(false, std::memory_order_release);
+		retired_.push_back(handlers_[fd]);
+		handlers_[fd] = nullptr;
+		has_retired_ = true;
+	}
+}
+
+void EpollPoller::free_retired()
+{
+	std::lock_guard<std::mutex> _l(mutex_);
+	for (auto h: retired_) {
+		delete h;
+	}
+	retired_.clear();
+	has_retired_ = false;
 }
 
 EpollPoller::Callback EpollPoller::get_cb(int fd)
 {
 	std::lock_guard<std::mutex> _l(mutex_);
-	auto it = cbs_.find(fd);
-	if (it != cbs_.end()) {
-		return it->second;
+	if (fd >= 0 && fd < (int) handlers_.size() && handlers_[fd]) {
+		return handlers_[fd]->cb;
 	}
 	return Callback(nullptr);
-}
\ No newline at end of file
+}
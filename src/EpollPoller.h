@@ -3,33 +3,67 @@
 
 #include <atomic>
 #include <mutex>
-#include <map>
+#include <vector>
 #include <functional>
+#include <sys/epoll.h>
+
+#include "Task.h"
+#include "Metrics.h"
+#include "MpscQueue.h"
 
 class EpollPoller
 {
 public:
 	typedef std::function<void(int, short)> Callback;
 
-	EpollPoller();
+	EpollPoller(Metrics* metrics = nullptr);
 
 	~EpollPoller();
 
-	void add_fd(int fd, Callback cb);
+	// `events` may have EPOLLET, then `cb` must read until EAGAIN
+	void add_fd(int fd, Callback cb, uint32_t events = EPOLLIN);
 
 	void remove_fd(int fd);
 
 	Callback get_cb(int fd);
 
+	// run `task` in the loop thread, wake it up by an eventfd
+	void post(Task task);
+
 	void loop();
 
 	void stop();
 
+private:
+	// referenced by `epoll_event.data.ptr`, never changed once registered,
+	// and freed by the loop thread only after the batch it may be in.
+	struct Handler {
+		int fd;
+		Callback cb;
+		std::atomic<bool> active;
+		Handler(int f, Callback c) : fd(f), cb(c), active(true) {}
+	};
+
+	void on_wakeup(int fd, short events);
+	void free_retired();
+
 private:
 	int epfd_;
-	std::map<int, Callback> cbs_;
+	int wakeup_fd_;
+	std::atomic<bool> wakeup_pending_{false};
+	MpscQueue<QueuedTask> pending_;
+	std::vector<QueuedTask> overflow_;  // when `pending_` is full, under `mutex_`
+	std::atomic<bool> overflowed_{false};
+	std::vector<QueuedTask> batch_;
+	std::vector<Handler*> handlers_;  // indexed by fd, under `mutex_`
+	std::vector<Handler*> retired_;   // removed, under `mutex_`
+	std::atomic<bool> has_retired_{false};
 	std::mutex mutex_;
 	std::atomic<bool> stop_{false};
+
+	Metrics::Counter* wakeups_;
+	Metrics::Counter* events_;
+	Metrics::Histogram* task_wait_;
 };
 
-#endif  // _EPOLL_POLLER_H_
\ No newline at end of file
+#endif  // _EPOLL_POLLER_H_
@@ -1,20 +1,40 @@
 #include "FileSystemWatcher.h"
 #include "RuntimeError.h"
+#include "Logger.h"
 
+#include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include <sys/inotify.h>
 #include <linux/limits.h>
 #include <vector>
+#include <algorithm>
 #include <stdexcept>
 
-FileSystemWatcher::FileSystemWatcher(Callback cb)
-	: default_cb_(cb)
+const size_t FileSystemWatcher::kScanThreads;
+
+// few scans, a new tree or an overflow, a helper does
+FileSystemWatcher::FileSystemWatcher(Callback cb, Metrics* metrics)
+	: default_cb_(cb), next_handle_(1), scanner_(kScanThreads), dir_wd_(-1), overflowed_(false), read_us_(0)
 {
 	fd_ = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
 	if (fd_ < 0) {
 		throw RuntimeError("inotify_init failed:");
 	}
+
+	if (!metrics) {
+		metrics = Metrics::none();
+	}
+	events_ = metrics->counter("autodeploy_fs_events_total{backend=\"inotify\"}", "Filesystem events seen.");
+	overflows_ = metrics->counter("autodeploy_fs_overflows_total", "Inotify queue overflows, each followed by a rescan.");
+	delay_ = metrics->histogram("autodeploy_fs_event_delay_seconds",
+		"Time from reading an inotify event to its callback returned.");
+	metrics->gauge("autodeploy_fs_watches{backend=\"inotify\"}", "Watched directories or trees.", [this] {
+		return (double) watch_count();
+	});
 }
 
 FileSystemWatcher::~FileSystemWatcher()
@@ -24,111 +44,621 @@ FileSystemWatcher::~FileSystemWatcher()
 	}
 }
 
-void FileSystemWatcher::add_watch(std::string path, uint32_t mask)
+int FileSystemWatcher::add_watch(std::string path, uint32_t mask)
 {
-	add_watch(path, mask, default_cb_);
+	return add_watch(path, mask, default_cb_);
 }
 
-bool FileSystemWatcher::remove_watch(std::string path)
+bool FileSystemWatcher::remove_watch(int handle)
 {
 	std::lock_guard<std::mutex> _l(mutex_);
-	auto it = wds_.find(path);
-	if (it != wds_.end()) { // found
-		int wd = it->second;
-		infos_.erase(wd);
-		if (inotify_rm_watch(fd_, wd) < 0) {
-			throw RuntimeError("inotify_rm_watch failed: ");
+	auto it = subs_.find(handle);
+	if (it == subs_.end()) {
+		return false;
+	}
+	int wd = it->second.wd;
+	bool recursive = it->second.mask & fsevent::RECURSIVE;
+	subs_.erase(it);
+
+	auto nit = nodes_.find(wd);
+	if (nit != nodes_.end()) {
+		auto& subs = nit->second.subs;
+		subs.erase(std::remove(subs.begin(), subs.end(), handle), subs.end());
+		prune(wd, recursive);
+	}
+	return true;
+}
+
+bool FileSystemWatcher::remove_watch(std::string path)
+{
+	std::vector<int> handles;
+	{
+		std::lock_guard<std::mutex> _l(mutex_);
+		for (auto& kv: subs_) {
+			if (kv.second.path == path) {
+				handles.push_back(kv.first);
+			}
 		}
-		return true;
 	}
-	return false;
+	for (int handle: handles) {
+		remove_watch(handle);
+	}
+	return handles.size() > 0;
 }
 
-static std::map<uint32_t, uint32_t> mask_map {
-	{fsevent::ACCESS, IN_ACCESS},
-	{fsevent::ATTRIB, IN_ATTRIB},
-	{fsevent::CREATE, IN_CREATE},
-	{fsevent::DELETE, IN_DELETE | IN_DELETE_SELF},
-	{fsevent::MODIFY, IN_MODIFY},
-	{fsevent::RENAME_FROM, IN_MOVE_SELF | IN_MOVED_FROM},
-	{fsevent::RENAME_TO, IN_MOVE_SELF | IN_MOVED_TO},
-	{fsevent::OPEN, IN_OPEN},
-	{fsevent::CLOSE, IN_CLOSE_WRITE | IN_CLOSE_NOWRITE}
+// inotify masks of each event bit, indexed by the bit number
+static constexpr uint32_t kEventMasks[] = {
+	IN_ACCESS,                          // ACCESS
+	IN_ATTRIB,                          // ATTRIB
+	IN_CREATE,                          // CREATE
+	IN_DELETE | IN_DELETE_SELF,         // DELETE
+	IN_MODIFY,                          // MODIFY
+	IN_MOVE_SELF | IN_MOVED_TO,         // RENAME_TO
+	IN_MOVE_SELF | IN_MOVED_FROM,       // RENAME_FROM
+	IN_OPEN,                            // OPEN
+	IN_CLOSE_WRITE | IN_CLOSE_NOWRITE,  // CLOSE
+};
+
+// event mask of each inotify event bit, indexed by the bit number
+static constexpr uint32_t kInotifyMasks[] = {
+	fsevent::ACCESS,                         // IN_ACCESS
+	fsevent::MODIFY,                         // IN_MODIFY
+	fsevent::ATTRIB,                         // IN_ATTRIB
+	fsevent::CLOSE,                          // IN_CLOSE_WRITE
+	fsevent::CLOSE,                          // IN_CLOSE_NOWRITE
+	fsevent::OPEN,                           // IN_OPEN
+	fsevent::RENAME_FROM,                    // IN_MOVED_FROM
+	fsevent::RENAME_TO,                      // IN_MOVED_TO
+	fsevent::CREATE,                         // IN_CREATE
+	fsevent::DELETE,                         // IN_DELETE
+	fsevent::DELETE,                         // IN_DELETE_SELF
+	fsevent::RENAME_FROM | fsevent::RENAME_TO,  // IN_MOVE_SELF
 };
 
+static const int kEventBits = sizeof(kEventMasks) / sizeof(kEventMasks[0]);
+static const int kInotifyBits = sizeof(kInotifyMasks) / sizeof(kInotifyMasks[0]);
+
+// events needed to keep a recursive watch in sync with the tree
+static const uint32_t kTreeMask = IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO;
+
+// room for many events per read, inotify never splits an event
+static const size_t kBufferSize = 64 << 10;
+
 // event mask to inotfy mask
-static uint32_t emask_to_imask(uint32_t mask)
+static constexpr uint32_t emask_to_imask(uint32_t mask, int bit = 0)
 {
-	uint32_t in_mask = 0; // inotify mask
-	for (auto& e: mask_map) {
-		if (mask & e.first) {
-			in_mask |= e.second;
-		}
-	}
-	return in_mask;	
+	return bit == kEventBits ? 0 :
+		((mask >> bit) & 1 ? kEventMasks[bit] : 0) | emask_to_imask(mask, bit + 1);
 }
 
 // inotify mask to event mask
-static uint32_t imask_to_emask(uint32_t imask)
+static constexpr uint32_t imask_to_emask(uint32_t imask, int bit = 0)
+{
+	return bit == kInotifyBits ? 0 :
+		((imask >> bit) & 1 ? kInotifyMasks[bit] : 0) | imask_to_emask(imask, bit + 1);
+}
+
+static_assert(emask_to_imask(fsevent::ALL_EVENTS) == IN_ALL_EVENTS, "event masks out of sync");
+static_assert(imask_to_emask(IN_ALL_EVENTS) == fsevent::ALL_EVENTS, "inotify masks out of sync");
+static_assert(imask_to_emask(IN_MOVE_SELF) == (fsevent::RENAME_FROM | fsevent::RENAME_TO), "");
+
+// append `dir`/`name` to `out`, no allocation once `out` is big enough
+static void append_path(std::string& out, const std::string& dir, const char* name, size_t len)
 {
-	uint32_t emask = 0;
-	for (auto& e: mask_map) {
-		if (imask & e.second) {
-			emask |= e.first;
+	out.append(dir);
+	if (len) {
+		if (dir.size() && dir.back() != '/') {
+			out.push_back('/');
 		}
+		out.append(name, len);
 	}
-	return emask;
 }
 
-void FileSystemWatcher::add_watch(std::string path, uint32_t mask, Callback cb)
+// inotify mask a subscription needs on its path
+static uint32_t sub_imask(uint32_t mask)
 {
 	uint32_t in_mask = emask_to_imask(mask);
-	
-	remove_watch(path);
+	if (mask & fsevent::RECURSIVE) {
+		in_mask |= kTreeMask;
+	}
+	return in_mask;
+}
+
+int FileSystemWatcher::add_watch(std::string path, uint32_t mask, Callback cb)
+{
+	std::unique_lock<std::mutex> _l(mutex_);
 
-	int wd = inotify_add_watch(fd_, path.c_str(), in_mask);
+	// IN_MASK_ADD keeps the events of other subscribers of this inode
+	uint32_t in_mask = sub_imask(mask);
+	int wd = inotify_add_watch(fd_, path.c_str(), in_mask | IN_MASK_ADD);
 	if (wd < 0) {
 		throw RuntimeError("inotify_add_watch failed:");
 	}
+	auto it = nodes_.find(wd);
+	if (it == nodes_.end()) {
+		it = nodes_.insert(std::make_pair(wd, WatchNode(-1, path))).first;
+	}
+	bool covered = subtree_mask(wd) != 0;  // already in the snapshot
+	WatchNode& node = it->second;
+	node.in_mask |= in_mask;
 
-	std::lock_guard<std::mutex> _l(mutex_);
-	wds_[path] = wd;
-	infos_[wd] = WatchInfo(path, mask, cb);
+	int handle = next_handle_++;
+	node.subs.push_back(handle);
+	subs_[handle] = Subscription(path, mask, cb, wd);
+
+	if (mask & fsevent::RECURSIVE) {
+		std::string dir;
+		build_path(wd, dir);
+		add_subtree(wd, dir, subtree_mask(wd));
+		if (!covered) {
+			// the slow part, without the lock, events meanwhile are newer
+			_l.unlock();
+			TreeScanner::Snapshot snap;
+			scanner_.scan(std::vector<std::string>(1, dir), &snap);
+			_l.lock();
+			snapshot_.insert(snap.begin(), snap.end());
+		}
+	}
+	return handle;
 }
 
-int FileSystemWatcher::get_wd(std::string path)
+// subscriptions covering `wd`: those on it, and the recursive ones on its
+// ancestors, return the inotify mask they need.
+uint32_t FileSystemWatcher::covering(int wd, std::vector<const Subscription*>* subs)
 {
-	std::lock_guard<std::mutex> _l(mutex_);
-	auto it = wds_.find(path);
-	if (it != wds_.end()) {
-		return it->second;
+	uint32_t in_mask = 0;
+	bool self = true;
+	for (auto it = nodes_.find(wd); it != nodes_.end(); it = nodes_.find(it->second.parent)) {
+		for (int handle: it->second.subs) {
+			auto sit = subs_.find(handle);
+			if (sit == subs_.end() || (!self && !(sit->second.mask & fsevent::RECURSIVE))) {
+				continue;
+			}
+			in_mask |= sub_imask(sit->second.mask);
+			if (subs) {
+				subs->push_back(&sit->second);
+			}
+		}
+		if (it->second.parent < 0 || it->second.detached) {
+			break;
+		}
+		self = false;
+	}
+	return in_mask;
+}
+
+// inotify mask the sub-directories of `wd` need, 0 if not watched
+uint32_t FileSystemWatcher::subtree_mask(int wd)
+{
+	std::vector<const Subscription*> subs;
+	covering(wd, &subs);
+	uint32_t in_mask = 0;
+	for (auto sub: subs) {
+		if (sub->mask & fsevent::RECURSIVE) {
+			in_mask |= sub_imask(sub->mask);
+		}
+	}
+	return in_mask;
+}
+
+// walk directory `path` (watched as `parent`) and watch every sub-directory,
+// `path` is used as a scratch buffer and restored before return.
+void FileSystemWatcher::add_subtree(int parent, std::string& path, uint32_t in_mask)
+{
+	DIR* dir = opendir(path.c_str());
+	if (!dir) {  // not a directory, or removed already
+		return;
+	}
+	size_t len = path.size();
+	while (struct dirent* ent = readdir(dir)) {
+		const char* name = ent->d_name;
+		if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) {
+			continue;
+		}
+		// d_type saves a stat per entry, which matters on big trees
+		if (ent->d_type != DT_DIR && ent->d_type != DT_UNKNOWN) {
+			continue;
+		}
+		if (path.back() != '/') {
+			path.push_back('/');
+		}
+		path.append(name);
+		struct stat st;
+		if (ent->d_type == DT_DIR || (lstat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode))) {
+			int wd = add_subdir(parent, path, name, in_mask);
+			if (wd >= 0) {
+				add_subtree(wd, path, in_mask);
+			}
+		}
+		path.resize(len);
+	}
+	closedir(dir);
+}
+
+// watch one sub-directory, return its wd if it needs a walk, or -1
+int FileSystemWatcher::add_subdir(int parent, const std::string& path, const char* name, uint32_t in_mask)
+{
+	int wd = inotify_add_watch(fd_, path.c_str(), in_mask | IN_ONLYDIR | IN_DONT_FOLLOW | IN_MASK_ADD);
+	if (wd < 0) {
+		if (errno == ENOENT || errno == ENOTDIR || errno == EACCES) {
+			return -1;  // changed during the walk, or not readable
+		}
+		throw RuntimeError("inotify_add_watch " + path + " failed: ");
+	}
+
+	auto it = nodes_.find(wd);
+	if (it == nodes_.end()) {
+		WatchNode& node = nodes_[wd];
+		node = WatchNode(parent, name);
+		node.in_mask = in_mask;
+		nodes_[parent].children.push_back(wd);
+		return wd;
+	}
+
+	// inotify returns the same wd for the same inode, so this directory is
+	// watched by another subscriber, or was moved inside the tree, or seen
+	// by both the walk and a IN_CREATE.
+	WatchNode& node = it->second;
+	bool grew = in_mask & ~node.in_mask;
+	node.in_mask |= in_mask;
+	if (node.parent != parent || node.detached || node.name != name) {
+		if (node.parent >= 0 && !node.detached) {
+			unlink_node(wd);
+		}
+		node.parent = parent;
+		node.name = name;
+		node.detached = false;
+		nodes_[parent].children.push_back(wd);
+	}
+	return grew ? wd : -1;  // walk again if its sub-directories need more
+}
+
+// update the kernel watch of `wd` and its sub-directories to what their
+// subscriptions need after one was removed, and drop the unneeded ones.
+void FileSystemWatcher::prune(int wd, bool recursive)
+{
+	std::string path;
+	std::vector<int> stack(1, wd);
+	while (stack.size()) {
+		int w = stack.back();
+		stack.pop_back();
+		auto it = nodes_.find(w);
+		if (it == nodes_.end()) {
+			continue;
+		}
+		WatchNode& node = it->second;
+		uint32_t in_mask = covering(w, nullptr);
+		if (recursive) {
+			stack.insert(stack.end(), node.children.begin(), node.children.end());
+		}
+
+		if (in_mask == 0) {
+			// the sub-directories left are watched by their own subscribers
+			for (int child: node.children) {
+				auto cit = nodes_.find(child);
+				if (cit != nodes_.end()) {
+					build_path(child, path);
+					cit->second.parent = -1;
+					cit->second.name = path;
+				}
+			}
+			unlink_node(w);
+			nodes_.erase(it);
+			if (inotify_rm_watch(fd_, w) < 0 && errno != EINVAL) {
+				throw RuntimeError("inotify_rm_watch failed: ");
+			}
+		} else if (in_mask != node.in_mask) {
+			build_path(w, path);
+			uint32_t flags = node.parent >= 0 ? IN_ONLYDIR | IN_DONT_FOLLOW : 0;
+			if (inotify_add_watch(fd_, path.c_str(), in_mask | flags) >= 0) {
+				node.in_mask = in_mask;
+			}
+		}
+	}
+}
+
+// detach `wd` from the children list of its parent
+void FileSystemWatcher::unlink_node(int wd)
+{
+	auto it = nodes_.find(wd);
+	if (it == nodes_.end() || it->second.parent < 0) {
+		return;
+	}
+	auto pit = nodes_.find(it->second.parent);
+	if (pit != nodes_.end()) {
+		auto& children = pit->second.children;
+		for (size_t i = 0; i < children.size(); i++) {
+			if (children[i] == wd) {
+				children[i] = children.back();
+				children.pop_back();
+				break;
+			}
+		}
+	}
+}
+
+// remove watches of `wd` and all its sub-directories, deleted or moved out
+void FileSystemWatcher::remove_subtree(int wd)
+{
+	unlink_node(wd);
+
+	std::vector<int> stack(1, wd);
+	while (stack.size()) {
+		int w = stack.back();
+		stack.pop_back();
+		auto it = nodes_.find(w);
+		if (it == nodes_.end()) {
+			continue;
+		}
+		stack.insert(stack.end(), it->second.children.begin(), it->second.children.end());
+		for (int handle: it->second.subs) {  // the path is gone
+			auto sit = subs_.find(handle);
+			if (sit != subs_.end()) {
+				sit->second.wd = -1;
+			}
+		}
+		nodes_.erase(it);
+		// fails with EINVAL if the kernel dropped it already (IN_IGNORED)
+		if (inotify_rm_watch(fd_, w) < 0 && errno != EINVAL) {
+			throw RuntimeError("inotify_rm_watch failed: ");
+		}
+	}
+}
+
+int FileSystemWatcher::find_child(int parent, const char* name)
+{
+	auto it = nodes_.find(parent);
+	if (it == nodes_.end()) {
+		return -1;
+	}
+	for (int wd: it->second.children) {
+		auto cit = nodes_.find(wd);
+		if (cit != nodes_.end() && cit->second.name == name) {
+			return wd;
+		}
 	}
 	return -1;
 }
 
-FileSystemWatcher::WatchInfo* FileSystemWatcher::get_info(int wd)
+// full path of a watched directory, by following the parent links
+void FileSystemWatcher::build_path(int wd, std::string& path)
+{
+	std::vector<const WatchNode*> chain;
+	for (auto it = nodes_.find(wd); it != nodes_.end(); it = nodes_.find(it->second.parent)) {
+		chain.push_back(&it->second);
+		if (it->second.parent < 0) {
+			break;
+		}
+	}
+	path.clear();
+	for (size_t i = chain.size(); i-- > 0; ) {
+		if (path.size() && path.back() != '/') {
+			path.push_back('/');
+		}
+		path.append(chain[i]->name);
+	}
+}
+
+// update the watch tree for a batch of events, and queue their deliveries
+void FileSystemWatcher::handle_events(const char* buffer, size_t nbytes)
 {
 	std::lock_guard<std::mutex> _l(mutex_);
-	auto it = infos_.find(wd);
-	if (it != infos_.end()) {
-		return &it->second;
+	dir_wd_ = -1;  // the tree may have changed since the last batch
+	for (const char* p = buffer; p < buffer + nbytes; ) {
+		auto evt = (const struct inotify_event*) p;
+		p += sizeof(struct inotify_event) + evt->len;  // move to next event
+		events_->add();
+		if (evt->mask & IN_Q_OVERFLOW) {  // events lost, rescan once drained
+			overflowed_ = true;
+			overflows_->add();
+			continue;
+		}
+		if (nodes_.find(evt->wd) == nodes_.end()) {
+			continue;
+		}
+		if (evt->wd != dir_wd_) {  // events often come in runs on one directory
+			build_path(evt->wd, dir_);
+			dir_wd_ = evt->wd;
+		}
+		// the name is padded with NULs
+		size_t name_len = evt->len ? strnlen(evt->name, evt->len) : 0;
+
+		covering_.clear();
+		covering(evt->wd, &covering_);
+		uint32_t emask = imask_to_emask(evt->mask);
+
+		// one copy of the path for all subscribers and the snapshot
+		size_t off = arena_.size();
+		append_path(arena_, dir_, evt->name, name_len);
+		size_t len = arena_.size() - off;
+		bool tree = false;  // only the trees of recursive watches are in the snapshot
+		for (auto sub: covering_) {
+			uint32_t mask = emask & sub->mask;
+			if (mask) {
+				Delivery d = {sub->cb, off, len, mask};
+				deliveries_.push_back(d);
+			}
+			tree |= (sub->mask & fsevent::RECURSIVE) != 0;
+		}
+		// skip runs of events on one file, e.g. many writes
+		if (tree && (touched_.empty() || touched_.back().second != len ||
+				arena_.compare(touched_.back().first, len, arena_, off, len) != 0)) {
+			touched_.push_back(std::make_pair(off, len));
+		}
+
+		if (evt->mask & IN_IGNORED) {  // deleted, or unmounted
+			remove_subtree(evt->wd);
+			dir_wd_ = -1;
+		} else if ((evt->mask & IN_ISDIR) && name_len) {
+			if (evt->mask & (IN_CREATE | IN_MOVED_TO)) {
+				uint32_t in_mask = subtree_mask(evt->wd);
+				if (in_mask) {
+					scratch_.clear();
+					append_path(scratch_, dir_, evt->name, name_len);
+					int wd = add_subdir(evt->wd, scratch_, evt->name, in_mask);
+					if (wd >= 0) {  // may be not empty, `mkdir -p` or moved in
+						add_subtree(wd, scratch_, in_mask);
+					}
+					dir_wd_ = -1;
+				}
+			} else if (evt->mask & IN_MOVED_FROM) {
+				// wait for the IN_MOVED_TO if it was moved inside the tree
+				int wd = find_child(evt->wd, evt->name);
+				if (wd >= 0) {
+					unlink_node(wd);
+					nodes_[wd].detached = true;
+					detached_.push_back(wd);
+					dir_wd_ = -1;
+				}
+			}
+		}
+	}
+}
+
+// run the queued deliveries, then bring the snapshot up to date
+void FileSystemWatcher::deliver()
+{
+	// called outside the lock, a callback may add or remove watches
+	for (auto& d: deliveries_) {
+		fsevent::Event event = {arena_.data() + d.off, d.len, d.mask};
+		(*d.cb)(event);
+		delay_->record(Metrics::now_us() - read_us_);
+	}
+	deliveries_.clear();
+
+	if (touched_.size()) {
+		std::unique_lock<std::mutex> _l(mutex_);
+		for (auto& t: touched_) {
+			scratch_.assign(arena_, t.first, t.second);
+			update_snapshot(scratch_);
+		}
+		touched_.clear();
+
+		if (new_dirs_.size()) {
+			// scan the new trees without the lock, then merge
+			_l.unlock();
+			TreeScanner::Snapshot snap;
+			scanner_.scan(new_dirs_, &snap);
+			new_dirs_.clear();
+			_l.lock();
+			for (auto& kv: snap) {
+				snapshot_[kv.first] = kv.second;
+			}
+		}
+	}
+	arena_.clear();
+}
+
+// re-stat an event path, only new files and moved in trees allocate
+void FileSystemWatcher::update_snapshot(const std::string& path)
+{
+	TreeScanner::Entry entry;
+	auto it = snapshot_.find(path);
+	if (!TreeScanner::stat_path(path.c_str(), &entry)) {
+		if (it == snapshot_.end()) {
+			return;
+		}
+		bool dir = it->second.dir;
+		snapshot_.erase(it);
+		if (dir) {  // removed or moved out with everything in it
+			for (auto sit = snapshot_.begin(); sit != snapshot_.end();) {
+				const std::string& p = sit->first;
+				if (p.size() > path.size() && p[path.size()] == '/' && p.compare(0, path.size(), path) == 0) {
+					sit = snapshot_.erase(sit);
+				} else {
+					++sit;
+				}
+			}
+		}
+		return;
+	}
+	if (it != snapshot_.end()) {
+		it->second = entry;
+	} else if (entry.dir) {  // created, or moved in not empty
+		snapshot_.insert(std::make_pair(path, entry));
+		new_dirs_.push_back(path);  // the rest by `deliver()`
+	} else {
+		snapshot_.insert(std::make_pair(path, entry));
 	}
-	return nullptr;
 }
 
-std::string path_join(std::string dir, std::string name)
+// after a queue overflow, watch the directories whose IN_CREATE was lost,
+// rescan the trees, and queue events for what differs from the snapshot.
+size_t FileSystemWatcher::reconcile()
 {
-	printf("path_join(%s, %s)\n", dir.c_str(), name.c_str());
-	if (dir.empty() || name.empty()) {
-		return dir + name;
+	std::vector<std::string> roots;
+	{
+		std::lock_guard<std::mutex> _l(mutex_);
+		std::vector<int> wds;
+		for (auto& kv: nodes_) {
+			if (kv.second.parent < 0) {
+				wds.push_back(kv.first);
+			}
+		}
+		for (int wd: wds) {
+			uint32_t in_mask = subtree_mask(wd);
+			if (in_mask) {
+				build_path(wd, scratch_);
+				add_subtree(wd, scratch_, in_mask);
+				roots.push_back(scratch_);
+			}
+		}
 	}
-	if (dir.size() && dir.back() == '/') {
-		dir.pop_back();
+
+	// the slow part, without the lock
+	TreeScanner::Snapshot snap;
+	scanner_.scan(roots, &snap);
+
+	std::lock_guard<std::mutex> _l(mutex_);
+	std::unordered_map<std::string, int> dirs;  // path -> wd
+	for (auto& kv: nodes_) {
+		build_path(kv.first, scratch_);
+		dirs[scratch_] = kv.first;
 	}
-	if (name.size() && name.substr(0, 2) == "./") {
-		name = name.substr(2);
+
+	size_t changes = 0;
+	TreeScanner::diff(snapshot_, snap, [&](const std::string& path, TreeScanner::Change change) {
+		size_t slash = path.rfind('/');
+		auto it = dirs.find(path.substr(0, slash == path.npos ? 0 : slash));
+		if (it == dirs.end()) {  // not under a watched directory any more
+			return;
+		}
+		changes++;
+		uint32_t emask = change == TreeScanner::CREATED ? fsevent::CREATE | fsevent::MODIFY :
+			change == TreeScanner::MODIFIED ? fsevent::MODIFY : fsevent::DELETE;
+		covering_.clear();
+		covering(it->second, &covering_);
+		size_t off = arena_.size();
+		arena_.append(path);
+		for (auto sub: covering_) {
+			uint32_t mask = emask & sub->mask;
+			if (mask) {
+				Delivery d = {sub->cb, off, path.size(), mask};
+				deliveries_.push_back(d);
+			}
+		}
+	});
+	snapshot_.swap(snap);
+
+	// directories removed while the events were lost, IN_IGNORED included
+	for (auto& kv: dirs) {
+		auto it = nodes_.find(kv.second);
+		if (it == nodes_.end()) {
+			continue;  // removed with its parent
+		}
+		TreeScanner::Entry entry;
+		if (!TreeScanner::stat_path(kv.first.c_str(), &entry) || (it->second.parent >= 0 && !entry.dir)) {
+			remove_subtree(kv.second);
+		}
 	}
-	return dir + "/" + name;
+	dir_wd_ = -1;
+	return changes;
+}
+
+size_t FileSystemWatcher::watch_count()
+{
+	std::lock_guard<std::mutex> _l(mutex_);
+	return nodes_.size();
 }
 
 void FileSystemWatcher::run()
@@ -142,30 +672,46 @@ void FileSystemWatcher::run()
 		on_fd_events(fd_, 0);
 	}
 }
-	
+
 void FileSystemWatcher::on_fd_events(int fd, short events)
 {
-	char buffer[(sizeof(struct inotify_event) + PATH_MAX + 1)*4];
-	long nbytes = read(fd_, &buffer[0], sizeof(buffer));
-	if (nbytes < 0) {  // maybe blocking here...
-		throw RuntimeError("read failed: ");
+	if (!buffer_) {
+		buffer_.reset(new char[kBufferSize]);  // aligned for inotify_event
 	}
-	if (!nbytes) return;
-	// printf("nbytes: %ld\n", nbytes);
-	for (char* p = &buffer[0]; (p - &buffer[0]) < nbytes; ) {
-		auto evt = (struct inotify_event*) p;
-		// printf("raw event %x on '%s' with %d %d\n", evt->mask, evt->name, evt->len, evt->cookie);
-		auto info = get_info(evt->wd);
-		int mask = imask_to_emask(evt->mask);
-		if (info && mask) {
-			std::string full = path_join(info->path, evt->name);
-			info->cb(full, mask);
+	for (;;) {  // read until EAGAIN, the fd may be edge triggered
+		long nbytes = read(fd_, buffer_.get(), kBufferSize);
+		if (nbytes < 0) {
+			if (errno == EAGAIN) {
+				break;
+			}
+			throw RuntimeError("read failed: ");
+		}
+		if (!nbytes) break;
+		read_us_ = Metrics::now_us();
+		handle_events(buffer_.get(), nbytes);
+		deliver();
+
+		// the overflow event is the last one queued, the rest is lost
+		if (overflowed_) {
+			overflowed_ = false;
+			size_t n = reconcile();
+			LOGW("inotify queue overflowed, %zu changes found by rescan", n);
+			deliver();
 		}
-		p = evt->name + evt->len;  // move to next event
 	}
+
+	// moved out of the tree
+	std::lock_guard<std::mutex> _l(mutex_);
+	for (int wd: detached_) {
+		auto it = nodes_.find(wd);
+		if (it != nodes_.end() && it->second.detached) {
+			remove_subtree(wd);
+		}
+	}
+	detached_.clear();
 }
 
 int FileSystemWatcher::get_fd()
 {
 	return fd_;
-}
\ No newline at end of file
+}
@@ -3,67 +3,134 @@
 
 #include <map>
 #include <mutex>
+#include <memory>
 #include <string>
-#include <functional>
-
-namespace fsevent {
-	enum {
-		ACCESS      = 0x01,
-		ATTRIB      = 0x02,
-		CREATE      = 0x04,
-		DELETE      = 0x08,
-		MODIFY      = 0x10,
-		RENAME_TO   = 0x20,
-		RENAME_FROM = 0x40,
-		OPEN        = 0x80,
-		CLOSE       = 0x100,
-		ALL_EVENTS  = 0x1FF
-	};
-};
+#include <vector>
+#include <unordered_map>
+
+#include "Metrics.h"
+#include "TreeScanner.h"
+#include "WatchBackend.h"
 
-class FileSystemWatcher
+// Watches paths with one inotify instance.
+//
+// A path may be watched by many subscribers, each with its own mask and
+// callback. There is one kernel watch per directory, its mask is the union
+// of the masks of all subscribers covering it, so overlapping and nested
+// watches cost no extra inotify watches, and each event is fanned out to
+// every subscriber interested in it.
+//
+// Events are read in large batches, their paths are built in a reused
+// arena, and no heap allocation is made per event once it's warmed up.
+//
+// Recursive watches also keep a (inode, size, mtime) snapshot of their
+// trees, updated as events come. When the inotify queue overflows and
+// events are lost, the trees are rescanned and the differences are
+// delivered as events, so no change goes unnoticed.
+class FileSystemWatcher : public WatchBackend
 {
 public:
-	typedef std::function<void(std::string, uint32_t)> Callback;
+	FileSystemWatcher(Callback cb, Metrics* metrics = nullptr);
 
-	FileSystemWatcher(Callback cb);
-	
 	~FileSystemWatcher();
 
-	void add_watch(std::string path, uint32_t mask);
+	int add_watch(std::string path, uint32_t mask);
 
-	void add_watch(std::string path, uint32_t mask, Callback cb);
+	int add_watch(std::string path, uint32_t mask, Callback cb) override;
 
+	bool remove_watch(int handle) override;
+
+	// remove all subscriptions of `path`
 	bool remove_watch(std::string path);
 
-	void on_fd_events(int fd, short events);
+	void on_fd_events(int fd, short events) override;
 
-	int get_fd();
+	int get_fd() override;
 
 	void run();
 
+	// number of kernel watches
+	size_t watch_count() override;
+
+	// threads of a tree scan, the caller included
+	static const size_t kScanThreads = 2;
+
 private:
-	struct WatchInfo
+	struct Subscription
 	{
 		std::string path;
-		uint32_t mask{0};
-		Callback cb;
-		WatchInfo() : path(), mask(0), cb() {}
-		WatchInfo(std::string p, uint32_t m, Callback c) : path(p), mask(m), cb(c) {}
-		WatchInfo(const WatchInfo&) = default;
-		WatchInfo& operator=(const WatchInfo&) = default;
+		uint32_t mask;
+		std::shared_ptr<Callback> cb;  // shared with pending deliveries
+		int wd;             // -1 if the path was removed
+		Subscription() : path(), mask(0), cb(), wd(-1) {}
+		Subscription(std::string p, uint32_t m, Callback c, int w)
+			: path(p), mask(m), cb(std::make_shared<Callback>(std::move(c))), wd(w) {}
+	};
+
+	// an event for one subscriber, its path is at `off` in `arena_`
+	struct Delivery
+	{
+		std::shared_ptr<Callback> cb;
+		size_t off;
+		size_t len;
+		uint32_t mask;
 	};
-	int get_wd(std::string path);
-	WatchInfo* get_info(int wd);
+
+	// one per kernel watch, a directory tree is kept as wd links,
+	// so a node only stores its own name instead of the full path.
+	struct WatchNode
+	{
+		int parent;         // wd of parent directory, -1 for roots
+		bool detached;      // moved out, waiting for a IN_MOVED_TO
+		uint32_t in_mask;   // mask of the kernel watch
+		std::string name;   // name in parent, full path for roots
+		std::vector<int> children;
+		std::vector<int> subs;  // handles of subscriptions on this path
+		WatchNode() : parent(-1), detached(false), in_mask(0), name(), children(), subs() {}
+		WatchNode(int p, std::string n) : parent(p), detached(false), in_mask(0), name(n), children(), subs() {}
+	};
+
+	uint32_t covering(int wd, std::vector<const Subscription*>* subs);
+	uint32_t subtree_mask(int wd);
+	void add_subtree(int parent, std::string& path, uint32_t in_mask);
+	int add_subdir(int parent, const std::string& path, const char* name, uint32_t in_mask);
+	void prune(int wd, bool recursive);
+	void remove_subtree(int wd);
+	void unlink_node(int wd);
+	int find_child(int parent, const char* name);
+	void build_path(int wd, std::string& path);
+	void handle_events(const char* buffer, size_t nbytes);
+	void deliver();
+	void update_snapshot(const std::string& path);
+	size_t reconcile();
 
 private:
 	int fd_;
 	Callback default_cb_;
 	std::mutex mutex_;
-	std::map<std::string, int> wds_;
-	std::map<int, WatchInfo> infos_;
-};
+	int next_handle_;
+	std::map<int, Subscription> subs_;
+	std::unordered_map<int, WatchNode> nodes_;
+	std::vector<int> detached_;
+	TreeScanner scanner_;
+	TreeScanner::Snapshot snapshot_;  // of the trees of recursive watches
 
-#endif  // _FILE_SYSTEM_WATCHER_H_
+	// used by `on_fd_events()` only, kept to reuse their memory
+	std::unique_ptr<char[]> buffer_;
+	std::string arena_;
+	std::string dir_;  // path of `dir_wd_`
+	int dir_wd_;
+	std::string scratch_;
+	std::vector<const Subscription*> covering_;
+	std::vector<Delivery> deliveries_;
+	std::vector<std::pair<size_t, size_t>> touched_;  // paths in `arena_` to re-stat
+	std::vector<std::string> new_dirs_;  // new in the snapshot, to scan
+	bool overflowed_;
+	uint64_t read_us_;  // when the batch being delivered was read
 
+	Metrics::Counter* events_;
+	Metrics::Counter* overflows_;
+	Metrics::Histogram* delay_;
+};
 
+#endif  // _FILE_SYSTEM_WATCHER_H_
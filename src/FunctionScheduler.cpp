@@ -3,50 +3,39 @@
 //
 
 #include "FunctionScheduler.h"
+#include "RuntimeError.h"
 
+#include <unistd.h>
+#include <sys/timerfd.h>
 
 using namespace std::chrono;
 
-struct RepeatFunc : public std::enable_shared_from_this<RepeatFunc> {
+static const uint64_t kNever = UINT64_MAX;
+
+struct RepeatFunc {
 	std::function<void(void)> cb;
 	std::chrono::milliseconds delay;
 	std::chrono::milliseconds interval;
 	std::string name;
 	int count;
 	bool once;
+	std::atomic<bool> canceled;
 
-	// maybe more than one function has the same `next run time`
-	std::shared_ptr<RepeatFunc> next;
+	// links in a wheel slot, `pprev` is null when not in the wheel
+	RepeatFunc* next;
+	RepeatFunc** pprev;
+	uint64_t expires;
+	int level;
+	int slot;
 
 public:
 	RepeatFunc(std::function<void()> f, std::chrono::milliseconds d, std::chrono::milliseconds i, std::string n)
-		: cb(f), delay(d), interval(i), name(n), count(0) {
+		: cb(f), delay(d), interval(i), name(n), count(0), canceled(false),
+		  next(nullptr), pprev(nullptr), expires(0), level(0), slot(0) {
 		once = (milliseconds(0) == interval);
-//		printf("RepeatFunc_%p born!\n", this);
-	}
-
-	RepeatFunc(std::function<void()> f, std::chrono::milliseconds d, std::string n)
-		: RepeatFunc(f, d, milliseconds(0), n) {
-		once = true;
 	}
 
-	~RepeatFunc() {
-//		printf("RepeatFunc_%p die!\n", this);
-	}
-
-	time_point<system_clock, milliseconds> next_run_time() const {
-		auto now = system_clock::now();
-		if (count == 0) {
-			return time_point_cast<milliseconds>(now + delay);
-		}
-		return time_point_cast<milliseconds>(now + interval);
-	}
-
-
 	void run() {
-		if (next) {
-			next->run();
-		}
 		if (cb) {
 			cb();
 
@@ -56,89 +45,266 @@ public:
 		}
 	}
 
-	std::shared_ptr<RepeatFunc> link(std::shared_ptr<RepeatFunc> other) {
-		this->next = other;
-		return shared_from_this();
-	}
-
 	bool valid() const {
-		return bool(cb);
+		return bool(cb) && !canceled;
 	}
 };
 
 FunctionScheduler::FunctionScheduler()
 	: thread_(),
       running_(false),
-      functions_(),
+      epoch_(steady_clock::now()),
+      current_(0),
+      wake_tick_(0),
+      timer_fd_(-1),
+      armed_tick_(kNever),
+      count_(0),
+      name_index_(),
       mutex_(),
       condition_()
 {
+	for (int level = 0; level < kLevels; level++) {
+		for (int slot = 0; slot < kSlots; slot++) {
+			wheel_[level][slot] = nullptr;
+		}
+		occupied_[level] = 0;
+	}
 }
 
 FunctionScheduler::~FunctionScheduler()
 {
 	shutdown();
+	if (timer_fd_ >= 0) {
+		close(timer_fd_);
+	}
 }
 
-std::shared_ptr<RepeatFunc> FunctionScheduler::take_front()
+uint64_t FunctionScheduler::now_ticks() const
 {
-	std::unique_lock<std::mutex> _lock(mutex_);
-	while (functions_.empty()) {
-		condition_.wait(_lock);
+	return duration_cast<milliseconds>(steady_clock::now() - epoch_).count();
+}
+
+// put `rf` in the slot of `expires`, on the lowest level it fits.
+void FunctionScheduler::push(RepeatFunc* rf, uint64_t expires, bool cascading)
+{
+	// the slot of current tick is processed already, but not during a cascade
+	if (expires < current_ + (cascading ? 0 : 1)) {
+		expires = current_ + 1;
 	}
+	rf->expires = expires;
 
-	auto it = functions_.begin();
+	uint64_t delta = expires - current_;
+	int level = 0;
+	while (level < kLevels - 1 && delta >> (kSlotBits * (level + 1))) {
+		level++;
+	}
+	if (delta >> (kSlotBits * kLevels)) {  // beyond the wheel, park on the last slot
+		expires = current_ + (1ULL << (kSlotBits * kLevels)) - 1;
+	}
+	int slot = (expires >> (kSlotBits * level)) & (kSlots - 1);
 
-	// blocking wait to the time point
-	std::this_thread::sleep_until(it->first);
+	RepeatFunc*& head = wheel_[level][slot];
+	rf->next = head;
+	if (head) {
+		head->pprev = &rf->next;
+	}
+	head = rf;
+	rf->pprev = &head;
+	rf->level = level;
+	rf->slot = slot;
+	occupied_[level] |= 1ULL << slot;
+}
 
-	auto prf = it->second;
+void FunctionScheduler::unlink(RepeatFunc* rf)
+{
+	if (!rf->pprev) {
+		return;
+	}
+	*rf->pprev = rf->next;
+	if (rf->next) {
+		rf->next->pprev = rf->pprev;
+	}
+	if (!wheel_[rf->level][rf->slot]) {
+		occupied_[rf->level] &= ~(1ULL << rf->slot);
+	}
+	rf->next = nullptr;
+	rf->pprev = nullptr;
+}
+
+// move tasks of the current slot of `level` down to lower levels
+void FunctionScheduler::cascade(int level)
+{
+	int slot = (current_ >> (kSlotBits * level)) & (kSlots - 1);
+	RepeatFunc* rf = wheel_[level][slot];
+	wheel_[level][slot] = nullptr;
+	occupied_[level] &= ~(1ULL << slot);
+	while (rf) {
+		RepeatFunc* next = rf->next;
+		push(rf, rf->expires, true);
+		rf = next;
+	}
+}
 
-	// unregister from schedule name map
-	if (prf && prf->name.size()) {
-		name_index_.erase(prf->name);
+// earliest tick after `current_` at which a non-empty slot is processed
+uint64_t FunctionScheduler::next_expiry() const
+{
+	uint64_t next = kNever;
+	for (int level = 0; level < kLevels; level++) {
+		uint64_t unit = 1ULL << (kSlotBits * level);
+		uint64_t period = unit << kSlotBits;
+		uint64_t base = current_ & ~(period - 1);
+		for (uint64_t bits = occupied_[level]; bits; bits &= bits - 1) {
+			uint64_t tick = base + __builtin_ctzll(bits) * unit;
+			if (tick <= current_) {
+				tick += period;
+			}
+			next = std::min(next, tick);
+		}
 	}
+	return next;
+}
 
-	// remove the front element
-	functions_.erase(it);
+// move to tick `now`, collect expired tasks to `due`
+void FunctionScheduler::advance(uint64_t now, std::vector<RepeatFunc*>* due)
+{
+	while (current_ < now) {
+		uint64_t next = next_expiry();
+		if (next > now) {  // nothing to do in between, jump over
+			current_ = now;
+			break;
+		}
+		current_ = next;
+		for (int level = 1; level < kLevels; level++) {
+			if (current_ & ((1ULL << (kSlotBits * level)) - 1)) {
+				break;
+			}
+			cascade(level);
+		}
+		RepeatFunc*& head = wheel_[0][current_ & (kSlots - 1)];
+		while (head) {
+			RepeatFunc* rf = head;
+			unlink(rf);
+			due->push_back(rf);
+		}
+	}
+}
 
-	return prf;
+void FunctionScheduler::release(RepeatFunc* rf)
+{
+	auto it = name_index_.find(rf->name);
+	if (it != name_index_.end() && it->second == rf) {
+		name_index_.erase(it);
+	}
+	count_--;
+	delete rf;
+}
+
+// run expired tasks, `lock` is released while they are running
+size_t FunctionScheduler::run_due(std::unique_lock<std::mutex>& lock)
+{
+	std::vector<RepeatFunc*> due;
+	advance(now_ticks(), &due);
+	if (due.empty()) {
+		return 0;
+	}
+
+	// unregister one-shot tasks from schedule name map
+	for (auto rf: due) {
+		if (rf->once && rf->name.size()) {
+			auto it = name_index_.find(rf->name);
+			if (it != name_index_.end() && it->second == rf) {
+				name_index_.erase(it);
+			}
+		}
+	}
+
+	// run callbacks without `mutex_` effects
+	lock.unlock();
+	for (auto rf: due) {
+		if (!rf->canceled) {
+			rf->run();
+		}
+	}
+	lock.lock();
+
+	for (auto rf: due) {
+		if (rf->valid()) {
+			push(rf, now_ticks() + rf->interval.count());
+		} else {
+			release(rf);
+		}
+	}
+	return due.size();
 }
 
 void FunctionScheduler::run()
 {
-	std::shared_ptr<RepeatFunc> prf;
+	std::unique_lock<std::mutex> _lock(mutex_);
 	while (running_) {
-		prf = take_front();
-		if (!prf) {
-			break;
+		if (run_due(_lock)) {
+			continue;
 		}
 
-		// run callback without `mutex_` effects
-		if (prf) {
-			prf->run();
+		// a new task earlier than `wake_tick_` notifies us
+		wake_tick_ = next_expiry();
+		if (wake_tick_ == kNever) {
+			condition_.wait(_lock);
+		} else {
+			condition_.wait_until(_lock, epoch_ + milliseconds(wake_tick_));
 		}
+		wake_tick_ = 0;
+	}
+}
 
-		if (prf->valid()) {
-			push_end(prf);
+int FunctionScheduler::get_fd()
+{
+	std::lock_guard<std::mutex> _l(mutex_);
+	if (timer_fd_ < 0) {
+		timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (timer_fd_ < 0) {
+			throw RuntimeError("timerfd_create failed");
 		}
+		arm_timer();
 	}
+	return timer_fd_;
 }
 
-void FunctionScheduler::push_end(std::shared_ptr<RepeatFunc> prf)
+void FunctionScheduler::on_fd_events(int fd, short events)
 {
-	std::lock_guard<std::mutex> _l(mutex_);
-	time_point<system_clock, milliseconds> nrt;  // next run time
-	if (prf) {
-		nrt = prf->next_run_time();
+	uint64_t expirations;
+	if (read(timer_fd_, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+		throw RuntimeError("read timerfd failed");
+	}
+
+	std::unique_lock<std::mutex> _lock(mutex_);
+	while (run_due(_lock)) {
+	}
+	armed_tick_ = kNever;
+	arm_timer();
+}
+
+// arm the timerfd to the earliest deadline, `mutex_` must be held
+void FunctionScheduler::arm_timer()
+{
+	if (timer_fd_ < 0) {
+		return;
+	}
+	uint64_t next = next_expiry();
+	if (next == armed_tick_) {
+		return;
+	}
+
+	struct itimerspec its = {{0, 0}, {0, 0}};  // disarm if no task
+	if (next != kNever) {
+		// steady_clock is CLOCK_MONOTONIC
+		auto at = duration_cast<nanoseconds>((epoch_ + milliseconds(next)).time_since_epoch()).count();
+		its.it_value.tv_sec = at / 1000000000;
+		its.it_value.tv_nsec = at % 1000000000;
 	}
-	auto it = functions_.find(nrt);
-	if (it != functions_.end()) { // found it, has same next run time!
-		it->second = prf->link(it->second);
-	} else {
-		functions_.insert(std::make_pair(nrt, prf));
+	if (timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		throw RuntimeError("timerfd_settime failed");
 	}
-	condition_.notify_one();
+	armed_tick_ = next;
 }
 
 void FunctionScheduler::schedule(std::function<void(void)> func,
@@ -146,39 +312,67 @@ void FunctionScheduler::schedule(std::function<void(void)> func,
                                  std::chrono::milliseconds interval,
                                  std::string name)
 {
-	std::shared_ptr<RepeatFunc> prf{new RepeatFunc(func, delay, interval, name)};
+	RepeatFunc* rf = new RepeatFunc(func, delay, interval, name);
 
+	std::lock_guard<std::mutex> _l(mutex_);
 	if (name.size()) {  // register a schedule name
-		std::lock_guard<std::mutex> _l(mutex_);
-		name_index_.insert(std::make_pair(name, prf));
+		name_index_.insert(std::make_pair(name, rf));
+	}
+	count_++;
+	push(rf, now_ticks() + delay.count());
+	if (rf->expires < wake_tick_) {
+		condition_.notify_one();
+	}
+	if (rf->expires < armed_tick_) {
+		arm_timer();
 	}
-
-	push_end(prf);
 }
 
 void FunctionScheduler::schedule(std::function<void(void)> func, std::chrono::milliseconds delay, std::string name)
 {
-	std::shared_ptr<RepeatFunc> prf{new RepeatFunc(func, delay, milliseconds(0), name)};
+	schedule(func, delay, milliseconds(0), name);
+}
 
-	if (name.size()) {  // register a schedule name
-		std::lock_guard<std::mutex> _l(mutex_);
-		name_index_.insert(std::make_pair(name, prf));
+bool FunctionScheduler::cancel(std::string name)
+{
+	std::lock_guard<std::mutex> _l(mutex_);
+	auto it = name_index_.find(name);
+	if (it == name_index_.end()) {
+		return false;
 	}
-
-	push_end(prf);
+	RepeatFunc* rf = it->second;
+	if (rf->pprev) {
+		unlink(rf);
+		release(rf);
+	} else {  // running now, released after it returns
+		rf->canceled = true;
+		name_index_.erase(it);
+	}
+	return true;
 }
 
 void FunctionScheduler::shutdown()
 {
-	running_ = false;
 	{
 		std::lock_guard<std::mutex> _l(mutex_);
-		functions_.clear();
-		name_index_.clear();
+		running_ = false;
+		condition_.notify_all();
 	}
 	if (thread_.joinable()) {
 		thread_.join();
 	}
+
+	std::lock_guard<std::mutex> _l(mutex_);
+	for (int level = 0; level < kLevels; level++) {
+		for (int slot = 0; slot < kSlots; slot++) {
+			while (RepeatFunc* rf = wheel_[level][slot]) {
+				unlink(rf);
+				delete rf;
+			}
+		}
+	}
+	name_index_.clear();
+	count_ = 0;
 }
 
 void FunctionScheduler::start()
@@ -193,3 +387,8 @@ bool FunctionScheduler::has_schedule(std::string name) const
 	return name_index_.count(name) > 0;
 }
 
+size_t FunctionScheduler::size() const
+{
+	std::lock_guard<std::mutex> _l(mutex_);
+	return count_;
+}
@@ -7,16 +7,26 @@
 
 #include <map>
 #include <mutex>
-#include <memory>
+#include <vector>
 #include <atomic>
 #include <chrono>
 #include <thread>
 #include <string>
+#include <stdint.h>
 #include <functional>
 #include <condition_variable>
 
-class RepeatFunc;
+struct RepeatFunc;
 
+// Runs functions after a delay, or repeatedly, on its own thread.
+//
+// Tasks live in a hierarchical timing wheel of 1ms ticks, so schedule and
+// cancel are O(1), and the thread waits on a condition variable until the
+// earliest deadline, which an earlier new task wakes up.
+//
+// Instead of `start()`, it can be driven by an event loop: `get_fd()`
+// returns a timerfd armed to the earliest deadline, and `on_fd_events()`
+// runs the expired tasks in the caller's thread.
 class FunctionScheduler
 {
 public:
@@ -33,24 +43,48 @@ public:
 	              std::chrono::milliseconds delay,
 	              std::string name = "");
 
+	bool cancel(std::string name);
+
 	void start();
 
 	void shutdown();
 
 	bool has_schedule(std::string name) const;
 
+	int get_fd();
+
+	void on_fd_events(int fd, short events);
+
+	size_t size() const;
+
 private:
-	void run();
-	std::shared_ptr<RepeatFunc> take_front();
-	void push_end(std::shared_ptr<RepeatFunc> prf);
+	static const int kLevels = 5;      // 64^5 ms, about 12 days
+	static const int kSlotBits = 6;
+	static const int kSlots = 1 << kSlotBits;
 
-	using time_point_t = std::chrono::time_point<std::chrono::system_clock, std::chrono::milliseconds>;
+	void run();
+	size_t run_due(std::unique_lock<std::mutex>& lock);
+	void arm_timer();
+	void push(RepeatFunc* rf, uint64_t expires, bool cascading = false);
+	void unlink(RepeatFunc* rf);
+	void cascade(int level);
+	void advance(uint64_t now, std::vector<RepeatFunc*>* due);
+	uint64_t next_expiry() const;
+	uint64_t now_ticks() const;
+	void release(RepeatFunc* rf);
 
 private:
 	std::thread thread_;
 	std::atomic<bool> running_;
-	std::map<time_point_t, std::shared_ptr<RepeatFunc>> functions_;
-	std::map<std::string, std::shared_ptr<RepeatFunc>> name_index_;
+	std::chrono::steady_clock::time_point epoch_;
+	uint64_t current_;    // last processed tick
+	uint64_t wake_tick_;  // tick the thread is waiting for
+	int timer_fd_;
+	uint64_t armed_tick_; // tick the timerfd is armed to
+	size_t count_;
+	RepeatFunc* wheel_[kLevels][kSlots];
+	uint64_t occupied_[kLevels];  // bitmap of non-empty slots
+	std::map<std::string, RepeatFunc*> name_index_;
 	mutable std::mutex mutex_;
 	std::condition_variable condition_;
 };
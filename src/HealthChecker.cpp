@@ -0,0 +1,403 @@
+#include "HealthChecker.h"
+#include "EpollPoller.h"
+#include "ListenSocket.h"
+#include "ServiceConfig.h"
+#include "RuntimeError.h"
+#include "Logger.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/timerfd.h>
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std::placeholders;
+
+static const size_t kMaxResponse = 1024;  // only the status line is needed
+
+HealthChecker::Spec HealthChecker::parse(const std::string& target)
+{
+	Spec spec;
+	spec.target = target;
+	if (target.compare(0, 5, "exec:") == 0) {
+		std::vector<std::string> args = ServiceConfig::split_args(target.substr(5));
+		if (args.empty()) {
+			throw std::invalid_argument("empty health command: " + target);
+		}
+		spec.type = EXEC;
+		spec.cmd = ProcessWatcher::Command(args);
+		return spec;
+	}
+
+	std::string addr, path = "/";
+	if (target.compare(0, 6, "tcp://") == 0) {
+		spec.type = TCP;
+		addr = target.substr(6);
+	} else if (target.compare(0, 7, "http://") == 0) {
+		spec.type = HTTP;
+		addr = target.substr(7);
+		size_t slash = addr.find('/');
+		if (slash != addr.npos) {
+			path = addr.substr(slash);
+			addr.erase(slash);
+		}
+		if (addr.rfind(':') == addr.npos || addr.back() == ']') {
+			addr += ":80";
+		}
+	} else {
+		throw std::invalid_argument("bad health check: " + target);
+	}
+	if (addr.empty() || addr[0] == ':' || !ListenSocket::parse(addr, &spec.addr, &spec.addr_len)) {
+		throw std::invalid_argument("bad health check address: " + target);
+	}
+	if (spec.type == HTTP) {
+		spec.request = "GET " + path + " HTTP/1.0\r\nHost: " + addr +
+			"\r\nUser-Agent: autodeploy\r\nConnection: close\r\n\r\n";
+	}
+	return spec;
+}
+
+HealthChecker::HealthChecker(EpollPoller* poller, ProcessWatcher* process_watcher, Metrics* metrics)
+	: poller_(poller), process_watcher_(process_watcher), next_handle_(0), size_(0), armed_us_(0)
+{
+	timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd_ < 0) {
+		throw RuntimeError("timerfd_create failed");
+	}
+	devnull_ = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+	if (!metrics) {
+		metrics = Metrics::none();
+	}
+	ok_ = metrics->counter("autodeploy_health_probes_total{result=\"ok\"}", "Health probes run.");
+	failed_ = metrics->counter("autodeploy_health_probes_total{result=\"failed\"}", "Health probes run.");
+	probe_time_ = metrics->histogram("autodeploy_health_probe_seconds", "Time a health probe took.");
+	metrics->gauge("autodeploy_health_checks", "Health checks added.", [this] { return (double) size_.load(); });
+}
+
+HealthChecker::~HealthChecker()
+{
+	for (auto& kv: probes_) {
+		if (kv.second.fd >= 0) {
+			close(kv.second.fd);
+		}
+	}
+	close(timer_fd_);
+	if (devnull_ >= 0) {
+		close(devnull_);
+	}
+}
+
+int HealthChecker::add(Spec spec, Callback cb)
+{
+	int handle = ++next_handle_;
+	size_++;
+	poller_->post(std::bind(&HealthChecker::do_add, this, handle, spec, cb));
+	return handle;
+}
+
+void HealthChecker::remove(int handle)
+{
+	size_--;
+	poller_->post(std::bind(&HealthChecker::do_remove, this, handle));
+}
+
+void HealthChecker::reset(int handle)
+{
+	poller_->post(std::bind(&HealthChecker::do_reset, this, handle));
+}
+
+void HealthChecker::pause(int handle)
+{
+	poller_->post(std::bind(&HealthChecker::do_pause, this, handle));
+}
+
+int HealthChecker::get_fd()
+{
+	return timer_fd_;
+}
+
+void HealthChecker::do_add(int handle, Spec spec, Callback cb)
+{
+	if (spec.type == EXEC && devnull_ >= 0) {
+		spec.cmd.set_output(devnull_);
+	}
+	Probe& probe = probes_[handle];
+	probe.spec = spec;
+	probe.cb = cb;
+	probe.seq = 0;
+	probe.running = false;
+	probe.paused = false;
+	probe.connected = false;
+	probe.fd = -1;
+	probe.pid = 0;
+	probe.started_us = 0;
+	probe.failures = 0;
+
+	heap_.push(Due(Metrics::now_us() + spec.interval_ms * 1000, handle, probe.seq));
+	arm();
+}
+
+void HealthChecker::do_remove(int handle)
+{
+	auto it = probes_.find(handle);
+	if (it == probes_.end()) {
+		return;
+	}
+	stop(it->second);
+	probes_.erase(it);  // its heap entries are skipped
+}
+
+void HealthChecker::do_reset(int handle)
+{
+	auto it = probes_.find(handle);
+	if (it == probes_.end()) {
+		return;
+	}
+	Probe& probe = it->second;
+	probe.failures = 0;
+	if (probe.paused) {
+		probe.paused = false;
+		heap_.push(Due(Metrics::now_us() + probe.spec.interval_ms * 1000, handle, probe.seq));
+		arm();
+	}
+}
+
+void HealthChecker::do_pause(int handle)
+{
+	auto it = probes_.find(handle);
+	if (it == probes_.end() || it->second.paused) {
+		return;
+	}
+	Probe& probe = it->second;
+	stop(probe);
+	probe.seq++;  // its heap entries are skipped
+	probe.paused = true;
+	probe.failures = 0;
+}
+
+// start the due probes, fail the timed out ones
+void HealthChecker::on_fd_events(int fd, short events)
+{
+	uint64_t count;
+	if (read(timer_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		return;
+	}
+	armed_us_ = 0;
+
+	uint64_t now = Metrics::now_us();
+	while (!heap_.empty() && std::get<0>(heap_.top()) <= now) {
+		Due due = heap_.top();
+		heap_.pop();
+		int handle = std::get<1>(due);
+		auto it = probes_.find(handle);
+		if (it == probes_.end() || it->second.seq != std::get<2>(due)) {
+			continue;
+		}
+		Probe& probe = it->second;
+		if (probe.running) {
+			finish(handle, probe, false, "timed out after " + std::to_string(probe.spec.timeout_ms) + "ms");
+		} else {
+			run(handle, probe);
+		}
+	}
+	arm();
+}
+
+void HealthChecker::run(int handle, Probe& probe)
+{
+	probe.running = true;
+	probe.started_us = Metrics::now_us();
+	heap_.push(Due(probe.started_us + probe.spec.timeout_ms * 1000, handle, probe.seq));
+
+	if (probe.spec.type != EXEC) {
+		connect(handle, probe);
+		return;
+	}
+	pid_t pid = process_watcher_->spwan_process(probe.spec.cmd);
+	if (pid < 0) {
+		finish(handle, probe, false, std::string("exec failed: ") + strerror(errno));
+		return;
+	}
+	probe.pid = pid;
+	pids_[pid] = handle;
+}
+
+void HealthChecker::connect(int handle, Probe& probe)
+{
+	const Spec& spec = probe.spec;
+	int fd = socket(spec.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		finish(handle, probe, false, std::string("socket failed: ") + strerror(errno));
+		return;
+	}
+	if (::connect(fd, (const struct sockaddr*) &spec.addr, spec.addr_len) < 0 && errno != EINPROGRESS) {
+		int err = errno;
+		close(fd);
+		finish(handle, probe, false, std::string("connect failed: ") + strerror(err));
+		return;
+	}
+	probe.fd = fd;
+	probe.connected = false;
+	probe.response.clear();
+	// writable once connected, then readable once the response comes
+	poller_->add_fd(fd, std::bind(&HealthChecker::on_socket_events, this, handle, _1, _2),
+		EPOLLIN | EPOLLOUT | EPOLLET);
+}
+
+void HealthChecker::on_socket_events(int handle, int fd, short events)
+{
+	auto it = probes_.find(handle);
+	if (it == probes_.end() || it->second.fd != fd) {
+		return;  // finished in the same batch
+	}
+	Probe& probe = it->second;
+
+	if (!probe.connected) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+			err = errno;
+		}
+		if (err) {
+			finish(handle, probe, false, std::string("connect failed: ") + strerror(err));
+			return;
+		}
+		if (!(events & EPOLLOUT)) {
+			return;
+		}
+		probe.connected = true;
+		if (probe.spec.type == TCP) {
+			finish(handle, probe, true, "");
+			return;
+		}
+		// a fresh socket buffer takes the whole request
+		const std::string& request = probe.spec.request;
+		if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) != (ssize_t) request.size()) {
+			finish(handle, probe, false, std::string("send failed: ") + strerror(errno));
+			return;
+		}
+	}
+
+	for (;;) {  // until EAGAIN, edge triggered
+		char buf[512];
+		ssize_t n = read(fd, buf, sizeof(buf));
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN) {
+				finish(handle, probe, false, std::string("read failed: ") + strerror(errno));
+			}
+			return;
+		}
+		probe.response.append(buf, std::min((size_t) n, kMaxResponse - probe.response.size()));
+		if (n == 0 || probe.response.find('\n') != std::string::npos || probe.response.size() >= kMaxResponse) {
+			on_response(handle, probe, n == 0);
+			return;
+		}
+	}
+}
+
+// judge by the status line, "HTTP/1.1 200 OK"
+void HealthChecker::on_response(int handle, Probe& probe, bool eof)
+{
+	const std::string& response = probe.response;
+	size_t space = response.find(' ');
+	if (response.compare(0, 5, "HTTP/") != 0 || space == response.npos) {
+		finish(handle, probe, false, eof && response.empty() ? "connection closed" : "bad response");
+		return;
+	}
+	int status = atoi(response.c_str() + space + 1);
+	if (status >= 200 && status < 400) {
+		finish(handle, probe, true, "");
+	} else {
+		finish(handle, probe, false, "status " + std::to_string(status));
+	}
+}
+
+bool HealthChecker::on_exit(pid_t pid, int status)
+{
+	auto pit = pids_.find(pid);
+	if (pit == pids_.end()) {
+		return false;
+	}
+	int handle = pit->second;
+	pids_.erase(pit);
+
+	auto it = probes_.find(handle);
+	if (it != probes_.end() && it->second.pid == pid) {
+		Probe& probe = it->second;
+		probe.pid = 0;
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+			finish(handle, probe, true, "");
+		} else if (WIFEXITED(status)) {
+			finish(handle, probe, false, "exit code " + std::to_string(WEXITSTATUS(status)));
+		} else {
+			finish(handle, probe, false, std::string("killed by ") + strsignal(WTERMSIG(status)));
+		}
+		arm();
+	}
+	return true;
+}
+
+void HealthChecker::finish(int handle, Probe& probe, bool ok, const std::string& reason)
+{
+	uint64_t now = Metrics::now_us();
+	probe_time_->record(now - probe.started_us);
+	stop(probe);
+	probe.seq++;
+	// keep the pace, unless the probe took longer than the interval
+	heap_.push(Due(std::max(now, probe.started_us + probe.spec.interval_ms * 1000), handle, probe.seq));
+
+	if (ok) {
+		ok_->add();
+		probe.failures = 0;
+		return;
+	}
+	failed_->add();
+	LOGD("health check %s failed: %s", probe.spec.target.c_str(), reason.c_str());
+	if (++probe.failures >= probe.spec.failures) {
+		probe.failures = 0;
+		Callback cb = probe.cb;  // may remove the probe
+		cb(reason);
+	}
+}
+
+// drop the socket or the command of a run in progress
+void HealthChecker::stop(Probe& probe)
+{
+	probe.running = false;
+	if (probe.fd >= 0) {
+		poller_->remove_fd(probe.fd);
+		close(probe.fd);
+		probe.fd = -1;
+	}
+	if (probe.pid > 0) {
+		// its exit is still ours
+		process_watcher_->kill_group(probe.pid, SIGKILL);
+		pids_[probe.pid] = 0;
+		probe.pid = 0;
+	}
+}
+
+// to the earliest deadline, if it changed
+void HealthChecker::arm()
+{
+	if (heap_.empty()) {
+		return;  // a spurious wakeup at most
+	}
+	uint64_t due = std::get<0>(heap_.top());
+	if (due == armed_us_) {
+		return;
+	}
+	struct itimerspec its = {{0, 0}, {0, 0}};
+	its.it_value.tv_sec = due / 1000000;
+	its.it_value.tv_nsec = due % 1000000 * 1000;
+	if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) {
+		its.it_value.tv_nsec = 1;  // zero disarms
+	}
+	timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &its, NULL);
+	armed_us_ = due;
+}
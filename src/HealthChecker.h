@@ -0,0 +1,131 @@
+#ifndef _HEALTH_CHECKER_H_
+#define _HEALTH_CHECKER_H_
+
+#include <queue>
+#include <tuple>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <functional>
+#include <unordered_map>
+#include <sys/socket.h>
+
+#include "Metrics.h"
+#include "ProcessWatcher.h"
+
+class EpollPoller;
+
+// Probes the health of services, without a thread per probe.
+//
+// A probe is a TCP connect, an HTTP GET expecting a 2xx or 3xx status, or
+// a command expecting exit code 0. All of them run in the loop thread of
+// `poller`: sockets are non-blocking and registered to it, commands are
+// spawned by `process_watcher` and their exits fed back by `on_exit()`.
+// The next runs and the timeouts of all probes are kept in one heap by
+// deadline, and a single timerfd is armed to the earliest.
+//
+// A probe reports unhealthy once it failed `failures` times in a row,
+// then counts again from 0, unless paused.
+class HealthChecker
+{
+public:
+	enum Type { TCP, HTTP, EXEC };
+
+	struct Spec {
+		Type type;
+		std::string target;            // as given, for logs
+		struct sockaddr_storage addr;  // TCP and HTTP
+		socklen_t addr_len;
+		std::string request;           // HTTP
+		ProcessWatcher::Command cmd;   // EXEC
+		long interval_ms;
+		long timeout_ms;
+		int failures;
+
+		Spec() : type(TCP), target(), addr(), addr_len(0), request(), cmd(),
+			interval_ms(5000), timeout_ms(1000), failures(3) {}
+	};
+
+	// called in the loop thread with the last failure
+	typedef std::function<void(const std::string& reason)> Callback;
+
+	// "tcp://host:port", "http://host:port/path" or "exec:/path/cmd args",
+	// throws std::invalid_argument if bad
+	static Spec parse(const std::string& target);
+
+	HealthChecker(EpollPoller* poller, ProcessWatcher* process_watcher, Metrics* metrics = nullptr);
+
+	~HealthChecker();
+
+	// run `spec` every `interval_ms` from now on, return its handle,
+	// thread safe like `remove()` and `reset()`
+	int add(Spec spec, Callback cb);
+
+	void remove(int handle);
+
+	// count the failures from 0 again, e.g. for a new process, and resume
+	// a paused probe
+	void reset(int handle);
+
+	// stop probing until `reset()`, e.g. while an unhealthy process stops
+	void pause(int handle);
+
+	// in the loop thread, true if `pid` was spawned by a probe
+	bool on_exit(pid_t pid, int status);
+
+	// the timerfd
+	int get_fd();
+
+	void on_fd_events(int fd, short events);
+
+private:
+	struct Probe {
+		Spec spec;
+		Callback cb;
+		uint64_t seq;         // bumped per run, older heap entries are stale
+		bool running;
+		bool paused;
+		bool connected;
+		int fd;
+		pid_t pid;
+		uint64_t started_us;
+		int failures;         // in a row
+		std::string response;
+	};
+
+	// (due, handle, seq), the next run if the probe is idle, else its timeout
+	typedef std::tuple<uint64_t, int, uint64_t> Due;
+
+	void do_add(int handle, Spec spec, Callback cb);
+	void do_remove(int handle);
+	void do_reset(int handle);
+	void do_pause(int handle);
+	void run(int handle, Probe& probe);
+	void connect(int handle, Probe& probe);
+	void on_socket_events(int handle, int fd, short events);
+	void on_response(int handle, Probe& probe, bool eof);
+	void finish(int handle, Probe& probe, bool ok, const std::string& reason);
+	void stop(Probe& probe);
+	void arm();
+
+private:
+	EpollPoller* poller_;
+	ProcessWatcher* process_watcher_;
+	int timer_fd_;
+	int devnull_;        // output of the commands
+	std::atomic<int> next_handle_;
+	std::atomic<size_t> size_;
+
+	// loop thread only
+	std::unordered_map<int, Probe> probes_;
+	std::unordered_map<pid_t, int> pids_;  // command -> handle, 0 if timed out
+	std::priority_queue<Due, std::vector<Due>, std::greater<Due>> heap_;
+	uint64_t armed_us_;  // 0 if disarmed
+
+	Metrics::Counter* ok_;
+	Metrics::Counter* failed_;
+	Metrics::Histogram* probe_time_;
+};
+
+#endif  // _HEALTH_CHECKER_H_
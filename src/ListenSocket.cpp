@@ -0,0 +1,90 @@
+#include "ListenSocket.h"
+#include "RuntimeError.h"
+
+#include <stdexcept>
+#include <netdb.h>
+#include <unistd.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+bool ListenSocket::parse(const std::string& addr, struct sockaddr_storage* sa, socklen_t* len)
+{
+	size_t colon = addr.rfind(':');
+	if (colon == addr.npos) {
+		return false;
+	}
+	std::string host = addr.substr(0, colon);
+	std::string port = addr.substr(colon + 1);
+	if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+		host = host.substr(1, host.size() - 2);
+	}
+
+	struct addrinfo hints, *res = nullptr;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+	if (getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &res) != 0) {
+		return false;
+	}
+	memcpy(sa, res->ai_addr, res->ai_addrlen);
+	*len = res->ai_addrlen;
+	freeaddrinfo(res);
+	return true;
+}
+
+int ListenSocket::open(const std::string& addr, int backlog)
+{
+	struct sockaddr_storage sa;
+	socklen_t len;
+	if (!parse(addr, &sa, &len)) {
+		throw std::invalid_argument("bad listen address: " + addr);
+	}
+
+	int fd = socket(sa.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		throw RuntimeError("socket failed");
+	}
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+	if (bind(fd, (struct sockaddr*) &sa, len) < 0 || listen(fd, backlog) < 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		throw RuntimeError("listen on " + addr + " failed ");
+	}
+	return fd;
+}
+
+int ListenSocket::open_unix(const std::string& path, int backlog)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.size() < 2 || path.size() >= sizeof(addr.sun_path)) {
+		throw std::invalid_argument("bad unix socket path: " + path);
+	}
+	memcpy(addr.sun_path, path.c_str(), path.size());
+	socklen_t len = sizeof(addr);
+	if (path[0] == '@') {
+		addr.sun_path[0] = '\0';
+		len = offsetof(struct sockaddr_un, sun_path) + path.size();
+	} else {
+		unlink(path.c_str());
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0) {
+		throw RuntimeError("socket failed");
+	}
+	if (bind(fd, (struct sockaddr*) &addr, len) < 0 || listen(fd, backlog) < 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		throw RuntimeError("listen on " + path + " failed ");
+	}
+	return fd;
+}
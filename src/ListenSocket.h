@@ -0,0 +1,24 @@
+#ifndef _LISTEN_SOCKET_H_
+#define _LISTEN_SOCKET_H_
+
+#include <string>
+#include <sys/socket.h>
+
+// TCP listening sockets owned by the daemon and passed to the children,
+// so connections queue in the kernel while a service restarts.
+class ListenSocket
+{
+public:
+	// "host:port", "[v6addr]:port" or ":port", return a CLOEXEC listening
+	// socket with SO_REUSEPORT, throws RuntimeError if failed
+	static int open(const std::string& addr, int backlog = 1024);
+
+	// resolve `addr` as above, return false if bad
+	static bool parse(const std::string& addr, struct sockaddr_storage* sa, socklen_t* len);
+
+	// non-blocking unix stream socket for local clients, "@name" is in the
+	// abstract namespace, a stale file at `path` is replaced
+	static int open_unix(const std::string& path, int backlog = 64);
+};
+
+#endif  // _LISTEN_SOCKET_H_
@@ -0,0 +1,355 @@
+#include "Logger.h"
+
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+
+const size_t Logger::kRingSize;
+const size_t Logger::kMaxText;
+const size_t Logger::Fields::kMaxFields;
+
+static const size_t kPrefixSize = 64;
+static const char kLevels[] = "DIWE";
+static const char* kLevelNames[] = {"debug", "info", "warn", "error"};
+
+std::atomic<int> Logger::level_{Logger::INFO};
+std::atomic<int> Logger::format_{Logger::TEXT};
+
+Logger::Fields& Logger::Fields::add(const char* key, const char* value, size_t len)
+{
+	if (n_ < kMaxFields) {
+		fields_[n_++] = Field{key, value, len, 0};
+	}
+	return *this;
+}
+
+Logger::Fields& Logger::Fields::add(const char* key, long long value)
+{
+	if (n_ < kMaxFields) {
+		fields_[n_++] = Field{key, nullptr, 0, value};
+	}
+	return *this;
+}
+
+// appends to a record text, truncated at its end
+struct TextWriter
+{
+	char* p;
+	char* end;
+
+	void put(char c) {
+		if (p < end) {
+			*p++ = c;
+		}
+	}
+
+	void put(const char* s, size_t len) {
+		len = std::min(len, (size_t) (end - p));
+		memcpy(p, s, len);
+		p += len;
+	}
+
+	// a logfmt value, quoted if empty or not a plain word
+	void put_value(const char* s, size_t len) {
+		bool quote = len == 0;
+		for (size_t i = 0; i < len && !quote; i++) {
+			quote = s[i] <= ' ' || s[i] == '"' || s[i] == '=' || s[i] == '\\';
+		}
+		if (!quote) {
+			put(s, len);
+			return;
+		}
+		put('"');
+		for (size_t i = 0; i < len; i++) {
+			char c = s[i];
+			if (c == '"' || c == '\\') {
+				put('\\');
+				put(c);
+			} else if (c == '\n') {
+				put("\\n", 2);
+			} else if (c == '\t') {
+				put("\\t", 2);
+			} else {
+				put(c);
+			}
+		}
+		put('"');
+	}
+};
+
+// marks the ring of a thread dead when it exits, the flusher frees
+// the ring once drained
+struct Logger::RingHolder
+{
+	std::shared_ptr<Ring> ring;
+
+	~RingHolder() {
+		if (ring) {
+			ring->dead = true;
+		}
+	}
+};
+
+Logger::Logger()
+	: fd_(STDOUT_FILENO), signaled_(false), stop_(false), flush_seq_(0), flushed_seq_(0),
+	  drops_(0), reported_drops_(0), cached_sec_(-1), cached_format_(TEXT)
+{
+	cached_date_[0] = '\0';
+	thread_ = std::thread(std::bind(&Logger::run, this));
+}
+
+Logger::~Logger()
+{
+	{
+		std::lock_guard<std::mutex> _l(mutex_);
+		stop_ = true;
+	}
+	cond_.notify_one();
+	thread_.join();
+}
+
+Logger& Logger::instance()
+{
+	static Logger logger;
+	return logger;
+}
+
+Logger::Ring* Logger::ring()
+{
+	static thread_local RingHolder holder;
+	if (!holder.ring) {
+		holder.ring = std::make_shared<Ring>();
+		holder.ring->tid = syscall(SYS_gettid);
+		Logger& logger = instance();
+		std::lock_guard<std::mutex> _l(logger.mutex_);
+		logger.rings_.push_back(holder.ring);
+	}
+	return holder.ring.get();
+}
+
+void Logger::log(int level, const char* fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vlog(level, nullptr, fmt, ap);
+	va_end(ap);
+}
+
+void Logger::log(int level, const Fields& fields, const char* fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vlog(level, &fields, fmt, ap);
+	va_end(ap);
+}
+
+void Logger::vlog(int level, const Fields* fields, const char* fmt, va_list ap)
+{
+	Ring* r = ring();
+	uint64_t head = r->head.load(std::memory_order_relaxed);
+	if (head - r->tail.load(std::memory_order_acquire) >= kRingSize) {
+		instance().drops_.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	Record& rec = r->records[head % kRingSize];
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	rec.time_us = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	rec.level = level;
+
+	bool logfmt = format_.load(std::memory_order_relaxed) == LOGFMT;
+	char msg[kMaxText];
+	int n = vsnprintf(msg, kMaxText, fmt, ap);
+	size_t len = n < 0 ? 0 : std::min((size_t) n, kMaxText - 1);
+	while (len && msg[len - 1] == '\n') {  // printf style callers
+		len--;
+	}
+
+	// room for the newline
+	TextWriter w = {rec.text, rec.text + kMaxText - 1};
+	if (logfmt) {
+		w.put("msg=", 4);
+		w.put_value(msg, len);
+	} else {
+		w.put(msg, len);
+	}
+	for (size_t i = 0; fields && i < fields->n_; i++) {
+		const Fields::Field& f = fields->fields_[i];
+		w.put(' ');
+		w.put(f.key, strlen(f.key));
+		w.put('=');
+		if (f.str) {
+			w.put_value(f.str, f.len);
+		} else {
+			char num[24];
+			w.put(num, snprintf(num, sizeof(num), "%lld", f.num));
+		}
+	}
+	*w.p++ = '\n';
+	rec.len = w.p - rec.text;
+
+	r->head.store(head + 1, std::memory_order_release);
+	instance().notify();
+}
+
+// wake the flusher, once per drain
+void Logger::notify()
+{
+	if (!signaled_.load(std::memory_order_relaxed) && !signaled_.exchange(true)) {
+		cond_.notify_one();
+	}
+}
+
+void Logger::set_fd(int fd)
+{
+	instance().fd_ = fd;
+}
+
+void Logger::flush()
+{
+	Logger& logger = instance();
+	std::unique_lock<std::mutex> lock(logger.mutex_);
+	uint64_t seq = ++logger.flush_seq_;
+	logger.cond_.notify_one();
+	logger.flushed_cond_.wait(lock, [&] { return logger.flushed_seq_ >= seq; });
+}
+
+uint64_t Logger::drops()
+{
+	return instance().drops_.load(std::memory_order_relaxed);
+}
+
+void Logger::run()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	for (;;) {
+		uint64_t seq = flush_seq_;
+		draining_ = rings_;
+		lock.unlock();
+
+		signaled_ = false;  // before draining, a record after it wakes us again
+		bool drained = drain();
+
+		lock.lock();
+		rings_.erase(std::remove_if(rings_.begin(), rings_.end(), [](const std::shared_ptr<Ring>& r) {
+			return r->dead && r->head.load() == r->tail.load();
+		}), rings_.end());
+		flushed_seq_ = seq;
+		flushed_cond_.notify_all();
+		if (drained) {
+			continue;
+		}
+		if (stop_) {
+			break;
+		}
+		// a notify may be missed without the lock, so don't wait forever
+		cond_.wait_for(lock, std::chrono::milliseconds(100), [this] {
+			return signaled_.load() || stop_ || flush_seq_ != flushed_seq_;
+		});
+	}
+}
+
+// write the records of all rings, return false if there were none
+bool Logger::drain()
+{
+	batch_.clear();
+	heads_.resize(draining_.size());
+	for (size_t i = 0; i < draining_.size(); i++) {
+		Ring* r = draining_[i].get();
+		heads_[i] = r->head.load(std::memory_order_acquire);
+		for (uint64_t t = r->tail.load(std::memory_order_relaxed); t < heads_[i]; t++) {
+			batch_.push_back(std::make_pair(&r->records[t % kRingSize], r->tid));
+		}
+	}
+
+	uint64_t drops = drops_.load(std::memory_order_relaxed);
+	if (batch_.empty() && drops == reported_drops_) {
+		return false;
+	}
+
+	// rings are in order, merge them
+	std::stable_sort(batch_.begin(), batch_.end(),
+		[](const std::pair<const Record*, int>& a, const std::pair<const Record*, int>& b) {
+			return a.first->time_us < b.first->time_us;
+		});
+
+	bool logfmt = format_.load(std::memory_order_relaxed) == LOGFMT;
+	prefixes_.resize((batch_.size() + 1) * kPrefixSize);
+	iov_.clear();
+	for (size_t i = 0; i < batch_.size(); i++) {
+		const Record* rec = batch_[i].first;
+		char* prefix = &prefixes_[i * kPrefixSize];
+		time_t sec = rec->time_us / 1000000;
+		if (sec != cached_sec_ || logfmt != (cached_format_ == LOGFMT)) {
+			struct tm tm;
+			localtime_r(&sec, &tm);
+			strftime(cached_date_, sizeof(cached_date_), logfmt ? "%Y-%m-%dT%H:%M:%S" : "%Y-%m-%d %H:%M:%S", &tm);
+			cached_sec_ = sec;
+			cached_format_ = logfmt ? LOGFMT : TEXT;
+		}
+		unsigned us = rec->time_us % 1000000;
+		int n = logfmt ?
+			snprintf(prefix, kPrefixSize, "time=%s.%06u level=%s tid=%d ", cached_date_, us,
+				kLevelNames[rec->level & 3], batch_[i].second) :
+			snprintf(prefix, kPrefixSize, "%s.%06u %c %d ", cached_date_, us,
+				kLevels[rec->level & 3], batch_[i].second);
+		struct iovec iov[2] = {
+			{prefix, std::min((size_t) n, kPrefixSize - 1)},
+			{(void*) rec->text, rec->len},
+		};
+		iov_.insert(iov_.end(), iov, iov + 2);
+	}
+
+	if (drops != reported_drops_) {
+		char* line = &prefixes_[batch_.size() * kPrefixSize];
+		unsigned long long dropped = drops - reported_drops_;
+		int n = logfmt ?
+			snprintf(line, kPrefixSize, "level=warn msg=\"log records dropped\" dropped=%llu\n", dropped) :
+			snprintf(line, kPrefixSize, "%llu log records dropped\n", dropped);
+		struct iovec iov = {line, std::min((size_t) n, kPrefixSize - 1)};
+		iov_.push_back(iov);
+		reported_drops_ = drops;
+	}
+	write_all(iov_.data(), iov_.size());
+
+	// the slots may be reused once written
+	for (size_t i = 0; i < draining_.size(); i++) {
+		draining_[i]->tail.store(heads_[i], std::memory_order_release);
+	}
+	draining_.clear();
+	return true;
+}
+
+void Logger::write_all(struct iovec* iov, size_t n)
+{
+	int fd = fd_;
+	while (n > 0) {
+		size_t count = std::min(n, (size_t) IOV_MAX);
+		ssize_t written = writev(fd, iov, count);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return;  // nowhere to report it
+		}
+		// skip what's written, resume a partial write
+		while (n > 0 && (size_t) written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (written > 0) {
+			iov->iov_base = (char*) iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+}
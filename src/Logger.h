@@ -0,0 +1,175 @@
+#ifndef _LOGGER_H_
+#define _LOGGER_H_
+
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <time.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <condition_variable>
+
+// levels below it are compiled out, arguments included
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL 0
+#endif
+
+#define LOG_AT(level, ...) do { \
+		if ((level) >= LOG_MIN_LEVEL && Logger::enabled(level)) { \
+			Logger::log(level, __VA_ARGS__); \
+		} \
+	} while (0)
+
+#define LOGD(...) LOG_AT(Logger::DEBUG, __VA_ARGS__)
+#define LOGI(...) LOG_AT(Logger::INFO, __VA_ARGS__)
+#define LOGW(...) LOG_AT(Logger::WARN, __VA_ARGS__)
+#define LOGE(...) LOG_AT(Logger::ERROR, __VA_ARGS__)
+
+// Leveled logger, off the calling thread.
+//
+// Each thread formats its records into its own ring, a single producer
+// single consumer queue, so logging takes no lock and makes no syscall.
+// A flusher thread drains all rings, orders the records by time, and
+// writes them in batches with writev(), one line per record:
+//
+//     2026-10-17 07:04:01.123456 I 1234 message
+//
+// with the level letter and the thread id. When a ring is full the record
+// is dropped and counted, the flusher reports the drops.
+//
+// A record may carry key/value fields, passed before the format:
+//
+//     LOGI(Logger::Fields().add("service", name).add("pid", pid), "ready in %ldms", ms);
+//
+// written after the message as `service=web pid=1234`, values quoted if
+// needed. In the LOGFMT format the whole line is key/value pairs:
+//
+//     time=2026-10-17T07:04:01.123456 level=info tid=1234 msg="ready in 80ms" service=web pid=1234
+class Logger
+{
+public:
+	enum Level { DEBUG, INFO, WARN, ERROR };
+
+	enum Format { TEXT, LOGFMT };
+
+	// fields of one record, refers to the values, so only lives for the
+	// log call, at most `kMaxFields`
+	class Fields
+	{
+	public:
+		static const size_t kMaxFields = 4;
+
+		Fields() : n_(0) {}
+
+		Fields& add(const char* key, const std::string& value) { return add(key, value.data(), value.size()); }
+		Fields& add(const char* key, const char* value) { return add(key, value, strlen(value)); }
+		Fields& add(const char* key, const char* value, size_t len);
+		Fields& add(const char* key, long long value);
+		Fields& add(const char* key, long value) { return add(key, (long long) value); }
+		Fields& add(const char* key, int value) { return add(key, (long long) value); }
+
+	private:
+		struct Field {
+			const char* key;
+			const char* str;  // null for a number
+			size_t len;
+			long long num;
+		};
+
+		Field fields_[kMaxFields];
+		size_t n_;
+
+		friend class Logger;
+	};
+
+	static const size_t kRingSize = 256;   // records per thread
+	static const size_t kMaxText = 240;    // longer messages are truncated
+
+	static bool enabled(int level) {
+		return level >= level_.load(std::memory_order_relaxed);
+	}
+
+	static void log(int level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+	static void log(int level, const Fields& fields, const char* fmt, ...) __attribute__((format(printf, 3, 4)));
+
+	static void set_level(int level) { level_ = level; }
+
+	// of the lines written from now on, TEXT by default
+	static void set_format(Format format) { format_ = format; }
+
+	// where the lines go, stdout by default
+	static void set_fd(int fd);
+
+	// wait until everything logged so far is written
+	static void flush();
+
+	static uint64_t drops();
+
+private:
+	struct Record
+	{
+		uint64_t time_us;  // wall clock
+		int level;
+		uint32_t len;
+		char text[kMaxText];
+	};
+
+	struct Ring
+	{
+		std::atomic<uint64_t> head{0};  // written by the owner thread
+		std::atomic<uint64_t> tail{0};  // written by the flusher
+		std::atomic<bool> dead{false};  // the owner thread exited
+		int tid;
+		Record records[kRingSize];
+	};
+
+	struct RingHolder;
+
+	Logger();
+
+	~Logger();
+
+	static Logger& instance();
+	static Ring* ring();
+	static void vlog(int level, const Fields* fields, const char* fmt, va_list ap);
+
+	void run();
+	bool drain();
+	void write_all(struct iovec* iov, size_t n);
+	void notify();
+
+private:
+	static std::atomic<int> level_;
+	static std::atomic<int> format_;
+
+	std::atomic<int> fd_;
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	std::condition_variable flushed_cond_;
+	std::atomic<bool> signaled_;
+	bool stop_;
+	uint64_t flush_seq_;   // flushes requested
+	uint64_t flushed_seq_; // flushes done
+	std::vector<std::shared_ptr<Ring>> rings_;  // under `mutex_`
+	std::atomic<uint64_t> drops_;
+	std::thread thread_;
+
+	// used by the flusher only, kept to reuse their memory
+	std::vector<std::shared_ptr<Ring>> draining_;
+	std::vector<uint64_t> heads_;
+	std::vector<std::pair<const Record*, int>> batch_;  // record, tid
+	std::vector<char> prefixes_;
+	std::vector<struct iovec> iov_;
+	uint64_t reported_drops_;
+	time_t cached_sec_;
+	int cached_format_;
+	char cached_date_[32];
+};
+
+#endif  // _LOGGER_H_
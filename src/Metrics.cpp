@@ -0,0 +1,234 @@
+#include "Metrics.h"
+
+#include <stdio.h>
+#include <chrono>
+#include <vector>
+
+const int Metrics::Histogram::kSubBits;
+const int Metrics::Histogram::kSubBuckets;
+const int Metrics::Histogram::kMaxBits;
+const int Metrics::Histogram::kBuckets;
+
+int Metrics::Histogram::bucket_of(uint64_t us)
+{
+	if (us < (uint64_t) kSubBuckets) {
+		return us;
+	}
+	if (us >> kMaxBits) {
+		return kBuckets - 1;
+	}
+	int msb = 63 - __builtin_clzll(us);
+	int shift = msb - kSubBits;
+	return ((shift + 1) << kSubBits) + ((us >> shift) & (kSubBuckets - 1));
+}
+
+uint64_t Metrics::Histogram::lower_bound(int bucket)
+{
+	if (bucket < kSubBuckets) {
+		return bucket;
+	}
+	int shift = (bucket >> kSubBits) - 1;
+	return (uint64_t) (kSubBuckets + (bucket & (kSubBuckets - 1))) << shift;
+}
+
+void Metrics::Histogram::record(uint64_t us)
+{
+	buckets_[bucket_of(us)].fetch_add(1, std::memory_order_relaxed);
+	count_.fetch_add(1, std::memory_order_relaxed);
+	sum_.fetch_add(us, std::memory_order_relaxed);
+}
+
+uint64_t Metrics::Histogram::count_below(uint64_t us) const
+{
+	int end = us >> kMaxBits ? kBuckets : bucket_of(us);
+	uint64_t n = 0;
+	for (int i = 0; i < end; i++) {
+		n += buckets_[i].load(std::memory_order_relaxed);
+	}
+	return n;
+}
+
+uint64_t Metrics::Histogram::quantile(double q) const
+{
+	uint64_t total = 0;
+	for (int i = 0; i < kBuckets; i++) {
+		total += buckets_[i].load(std::memory_order_relaxed);
+	}
+	uint64_t rank = total * q;
+	uint64_t n = 0;
+	for (int i = 0; i < kBuckets - 1; i++) {
+		n += buckets_[i].load(std::memory_order_relaxed);
+		if (n > rank) {
+			return lower_bound(i + 1);
+		}
+	}
+	return lower_bound(kBuckets - 1);
+}
+
+Metrics::Metrics()
+{
+}
+
+Metrics::~Metrics()
+{
+}
+
+Metrics* Metrics::none()
+{
+	static Metrics metrics;
+	return &metrics;
+}
+
+uint64_t Metrics::now_us()
+{
+	using namespace std::chrono;
+	return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+Metrics::Entry* Metrics::get(const std::string& name, const std::string& help, Type type)
+{
+	auto it = entries_.find(name);
+	if (it == entries_.end()) {
+		it = entries_.insert(std::make_pair(name, Entry())).first;
+		it->second.type = type;
+		it->second.help = help;
+	}
+	return &it->second;
+}
+
+Metrics::Counter* Metrics::counter(const std::string& name, const std::string& help)
+{
+	std::lock_guard<std::mutex> _l(mutex_);
+	Entry* e = get(name, help, COUNTER);
+	if (!e->counter) {
+		e->counter.reset(new Counter());
+	}
+	return e->counter.get();
+}
+
+void Metrics::counter(const std::string& name, const std::string& help, std::function<double()> fn)
+{
+	std::lock_guard<std::mutex> _l(mutex_);
+	get(name, help, COUNTER)->fn = fn;
+}
+
+Metrics::Gauge* Metrics::gauge(const std::string& name, const std::string& help)
+{
+	std::lock_guard<std::mutex> _l(mutex_);
+	Entry* e = get(name, help, GAUGE);
+	if (!e->gauge) {
+		e->gauge.reset(new Gauge());
+	}
+	return e->gauge.get();
+}
+
+void Metrics::gauge(const std::string& name, const std::string& help, std::function<double()> fn)
+{
+	std::lock_guard<std::mutex> _l(mutex_);
+	get(name, help, GAUGE)->fn = fn;
+}
+
+Metrics::Histogram* Metrics::histogram(const std::string& name, const std::string& help)
+{
+	std::lock_guard<std::mutex> _l(mutex_);
+	Entry* e = get(name, help, HISTOGRAM);
+	if (!e->histogram) {
+		e->histogram.reset(new Histogram());
+	}
+	return e->histogram.get();
+}
+
+// `base{labels}` of a histogram line, with `le` appended to the labels
+static std::string series(const std::string& base, const std::string& suffix,
+                          const std::string& labels, const char* le = nullptr)
+{
+	std::string s = base + suffix;
+	if (labels.empty() && !le) {
+		return s;
+	}
+	s += "{" + labels;
+	if (le) {
+		s += labels.empty() ? "" : ",";
+		s += "le=\"" + std::string(le) + "\"";
+	}
+	return s + "}";
+}
+
+std::string Metrics::render() const
+{
+	static const char* kTypes[] = {"counter", "gauge", "histogram"};
+
+	// a copy of the entries, functions may take other locks, so they
+	// are called after the registry lock is released. Metrics are never
+	// freed, the pointers stay valid.
+	struct Series {
+		std::string labels;
+		Type type;
+		std::string help;
+		const Counter* counter;
+		const Gauge* gauge;
+		const Histogram* histogram;
+		std::function<double()> fn;
+	};
+
+	// the series of a family, with different labels, must be together
+	std::map<std::string, std::vector<Series>> families;
+	{
+		std::lock_guard<std::mutex> _l(mutex_);
+		for (auto& kv: entries_) {
+			const std::string& name = kv.first;
+			const Entry& e = kv.second;
+			size_t brace = name.find('{');
+			std::string labels;
+			if (brace != name.npos && name.back() == '}') {
+				labels = name.substr(brace + 1, name.size() - brace - 2);
+			}
+			families[name.substr(0, brace)].push_back(Series{labels, e.type, e.help,
+				e.counter.get(), e.gauge.get(), e.histogram.get(), e.fn});
+		}
+	}
+
+	std::string out;
+	char buf[64];
+	for (auto& family: families) {
+		const std::string& base = family.first;
+		const Series& first = family.second[0];
+		out += "# HELP " + base + " " + first.help + "\n";
+		out += "# TYPE " + base + " " + kTypes[first.type] + "\n";
+		for (auto& s: family.second) {
+			const std::string& labels = s.labels;
+			if (s.type == COUNTER) {
+				if (s.fn) {
+					snprintf(buf, sizeof(buf), " %.12g\n", s.fn());
+				} else {
+					snprintf(buf, sizeof(buf), " %llu\n", (unsigned long long) (s.counter ? s.counter->value() : 0));
+				}
+				out += series(base, "", labels) + buf;
+			} else if (s.type == GAUGE) {
+				if (s.fn) {
+					snprintf(buf, sizeof(buf), " %.12g\n", s.fn());
+				} else {
+					snprintf(buf, sizeof(buf), " %lld\n", (long long) (s.gauge ? s.gauge->value() : 0));
+				}
+				out += series(base, "", labels) + buf;
+			} else if (s.histogram) {
+				// cumulative buckets at powers of 4 microseconds
+				const Histogram* h = s.histogram;
+				for (int bits = 0; bits <= Histogram::kMaxBits; bits += 2) {
+					char le[32];
+					snprintf(le, sizeof(le), "%.12g", (double) (1ULL << bits) / 1e6);
+					snprintf(buf, sizeof(buf), " %llu\n", (unsigned long long) h->count_below(1ULL << bits));
+					out += series(base, "_bucket", labels, le) + buf;
+				}
+				uint64_t count = h->count();
+				snprintf(buf, sizeof(buf), " %llu\n", (unsigned long long) count);
+				out += series(base, "_bucket", labels, "+Inf") + buf;
+				snprintf(buf, sizeof(buf), " %.12g\n", h->sum() / 1e6);
+				out += series(base, "_sum", labels) + buf;
+				snprintf(buf, sizeof(buf), " %llu\n", (unsigned long long) count);
+				out += series(base, "_count", labels) + buf;
+			}
+		}
+	}
+	return out;
+}
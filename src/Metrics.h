@@ -0,0 +1,117 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <stdint.h>
+#include <functional>
+
+// Counters, gauges and histograms, rendered in the Prometheus text format.
+//
+// Recording is lock-free, a metric is a few atomics updated with relaxed
+// order. The registry lock is only taken to register and to render, so
+// components look their metrics up once and keep the pointers.
+class Metrics
+{
+public:
+	class Counter
+	{
+	public:
+		void add(uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+		uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+	private:
+		std::atomic<uint64_t> value_{0};
+	};
+
+	class Gauge
+	{
+	public:
+		void set(int64_t v) { value_.store(v, std::memory_order_relaxed); }
+		void add(int64_t n) { value_.fetch_add(n, std::memory_order_relaxed); }
+		int64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+	private:
+		std::atomic<int64_t> value_{0};
+	};
+
+	// HDR style histogram of microseconds: each power of two is split in
+	// kSubBuckets linear buckets, so a value is recorded in O(1) within
+	// 1/kSubBuckets of relative error, from 1us to about 12 days.
+	class Histogram
+	{
+	public:
+		static const int kSubBits = 3;
+		static const int kSubBuckets = 1 << kSubBits;
+		static const int kMaxBits = 40;
+		static const int kBuckets = (kMaxBits - kSubBits + 1) << kSubBits;
+
+		void record(uint64_t us);
+		uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+		uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+
+		// number of values below `us`, exact at bucket bounds
+		uint64_t count_below(uint64_t us) const;
+
+		// upper bound of the bucket the `q` quantile falls in
+		uint64_t quantile(double q) const;
+
+		static int bucket_of(uint64_t us);
+		static uint64_t lower_bound(int bucket);
+
+	private:
+		std::atomic<uint64_t> buckets_[kBuckets] = {};
+		std::atomic<uint64_t> count_{0};
+		std::atomic<uint64_t> sum_{0};
+	};
+
+	Metrics();
+
+	~Metrics();
+
+	// `name` may have labels, like `events_total{backend="poll"}`, the same
+	// name returns the same metric, so components may share one.
+	Counter* counter(const std::string& name, const std::string& help);
+
+	// evaluated when rendered, for counts kept by someone else
+	void counter(const std::string& name, const std::string& help, std::function<double()> fn);
+
+	Gauge* gauge(const std::string& name, const std::string& help);
+
+	// evaluated when rendered, for values owned by someone else
+	void gauge(const std::string& name, const std::string& help, std::function<double()> fn);
+
+	// recorded in microseconds, rendered in seconds
+	Histogram* histogram(const std::string& name, const std::string& help);
+
+	std::string render() const;
+
+	// a registry nobody renders, for components built without one
+	static Metrics* none();
+
+	// steady clock in microseconds, for latencies
+	static uint64_t now_us();
+
+private:
+	enum Type { COUNTER, GAUGE, HISTOGRAM };
+
+	struct Entry {
+		Type type;
+		std::string help;
+		std::unique_ptr<Counter> counter;
+		std::unique_ptr<Gauge> gauge;
+		std::unique_ptr<Histogram> histogram;
+		std::function<double()> fn;
+	};
+
+	Entry* get(const std::string& name, const std::string& help, Type type);
+
+private:
+	mutable std::mutex mutex_;
+	std::map<std::string, Entry> entries_;  // sorted, so a family is rendered together
+};
+
+#endif  // _METRICS_H_
@@ -0,0 +1,143 @@
+#include "MetricsServer.h"
+#include "Metrics.h"
+#include "EpollPoller.h"
+#include "ListenSocket.h"
+#include "RuntimeError.h"
+
+#include <unistd.h>
+#include <sys/socket.h>
+
+using namespace std::placeholders;
+
+const size_t MetricsServer::kMaxRequest;
+
+MetricsServer::MetricsServer(Metrics* metrics, EpollPoller* poller)
+	: metrics_(metrics), poller_(poller), fd_(-1)
+{
+}
+
+MetricsServer::~MetricsServer()
+{
+	for (auto& kv: clients_) {
+		close(kv.first);
+	}
+	if (fd_ >= 0) {
+		close(fd_);
+		if (path_[0] != '@') {
+			unlink(path_.c_str());
+		}
+	}
+}
+
+void MetricsServer::listen(const std::string& path)
+{
+	fd_ = ListenSocket::open_unix(path);
+	path_ = path;
+}
+
+int MetricsServer::get_fd()
+{
+	return fd_;
+}
+
+void MetricsServer::on_fd_events(int fd, short events)
+{
+	for (;;) {  // accept until EAGAIN, the fd may be edge triggered
+		int client = accept4(fd_, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (client < 0) {
+			if (errno == ECONNABORTED || errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EMFILE || errno == ENFILE) {
+				break;  // out of fds, try again on the next connection
+			}
+			throw RuntimeError("accept failed");
+		}
+		clients_[client] = Client();
+		poller_->add_fd(client, std::bind(&MetricsServer::on_client_events, this, _1, _2),
+			EPOLLIN | EPOLLOUT | EPOLLET);
+	}
+}
+
+void MetricsServer::on_client_events(int fd, short events)
+{
+	auto it = clients_.find(fd);
+	if (it == clients_.end()) {
+		return;
+	}
+	Client& client = it->second;
+	while (!client.responded) {  // until EAGAIN, edge triggered
+		char buf[1024];
+		ssize_t n = read(fd, buf, sizeof(buf));
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN) {
+				close_client(fd);
+			}
+			return;
+		}
+		std::string& request = client.request;
+		request.append(buf, n);
+
+		// wait for the end of the HTTP headers, or of the line
+		bool http = request.compare(0, 4, "GET ") == 0;
+		bool complete = n == 0 || request.size() >= kMaxRequest ||
+			(http ? request.find("\r\n\r\n") != request.npos || request.find("\n\n") != request.npos
+			      : request.find('\n') != request.npos);
+		if (complete) {
+			client.response = respond(request);
+			client.responded = true;
+		}
+	}
+	if (!flush(fd, client) || client.response.empty()) {
+		close_client(fd);
+	}
+}
+
+std::string MetricsServer::respond(const std::string& request)
+{
+	std::string body = metrics_->render();
+	std::string response;
+	if (request.compare(0, 4, "GET ") == 0) {
+		size_t end = request.find(' ', 4);
+		std::string target = request.substr(4, end == request.npos ? end : end - 4);
+		if (target == "/" || target == "/metrics") {
+			response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n";
+		} else {
+			response = "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\n";
+			body = "not found\n";
+		}
+		response += "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n";
+	}
+	return response + body;
+}
+
+// write what the socket takes, the rest on EPOLLOUT, false if failed
+bool MetricsServer::flush(int fd, Client& client)
+{
+	size_t off = 0;
+	while (off < client.response.size()) {
+		ssize_t n = send(fd, client.response.data() + off, client.response.size() - off, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN) {
+				break;
+			}
+			return false;
+		}
+		off += n;
+	}
+	client.response.erase(0, off);
+	return true;
+}
+
+void MetricsServer::close_client(int fd)
+{
+	poller_->remove_fd(fd);
+	clients_.erase(fd);
+	close(fd);
+}
@@ -0,0 +1,56 @@
+#ifndef _METRICS_SERVER_H_
+#define _METRICS_SERVER_H_
+
+#include <map>
+#include <string>
+
+class Metrics;
+class EpollPoller;
+
+// Serves the metrics in the Prometheus text format on a unix stream
+// socket, to `curl --unix-socket <path> http://localhost/metrics`. A client
+// that sends a line not starting with "GET " gets the bare text.
+//
+// Clients are handled in the loop thread of `poller`, the response is
+// rendered in one go, and what a slow client doesn't take yet is written
+// once its socket is writable again.
+class MetricsServer
+{
+public:
+	MetricsServer(Metrics* metrics, EpollPoller* poller);
+
+	~MetricsServer();
+
+	// "@name" for the abstract namespace
+	void listen(const std::string& path);
+
+	bool listening() const { return fd_ >= 0; }
+
+	void on_fd_events(int fd, short events);
+
+	int get_fd();
+
+	static const size_t kMaxRequest = 8192;
+
+private:
+	struct Client {
+		std::string request;   // read so far
+		std::string response;  // not written yet
+		bool responded;
+		Client() : request(), response(), responded(false) {}
+	};
+
+	void on_client_events(int fd, short events);
+	std::string respond(const std::string& request);
+	bool flush(int fd, Client& client);
+	void close_client(int fd);
+
+private:
+	Metrics* metrics_;
+	EpollPoller* poller_;
+	int fd_;
+	std::string path_;
+	std::map<int, Client> clients_;  // by fd, loop thread only
+};
+
+#endif  // _METRICS_SERVER_H_
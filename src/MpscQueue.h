@@ -0,0 +1,134 @@
+#ifndef _MPSC_QUEUE_H_
+#define _MPSC_QUEUE_H_
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <memory>
+#include <condition_variable>
+
+// Bounded lock-free multi-producer single-consumer queue.
+//
+// A ring of slots with sequence numbers (D. Vyukov's bounded queue):
+// producers claim a slot with one CAS, the consumer drains every ready
+// slot in one go. The mutex and condition variable are only touched to
+// park the consumer when the queue is empty, and by producers to wake it.
+template <typename T>
+class MpscQueue
+{
+public:
+	MpscQueue(size_t cap)
+		: mask_(round_up(cap) - 1),
+		  slots_(new Slot[mask_ + 1]) {
+		for (size_t i = 0; i <= mask_; i++) {
+			slots_[i].seq.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	// returns false if the queue is full
+	bool try_put(T&& x) {
+		Slot* slot;
+		size_t pos = tail_.load(std::memory_order_relaxed);
+		for (;;) {
+			slot = &slots_[pos & mask_];
+			size_t seq = slot->seq.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+			if (diff == 0) {
+				if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = tail_.load(std::memory_order_relaxed);
+			}
+		}
+		slot->value = std::move(x);
+		slot->seq.store(pos + 1, std::memory_order_release);
+
+		// pairs with the fence in `take_all()`
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (sleeping_.load(std::memory_order_relaxed)) {
+			std::lock_guard<std::mutex> _l(mutex_);
+			cond_.notify_one();
+		}
+		return true;
+	}
+
+	// spins while the queue is full, never call it from the consumer
+	void put(T&& x) {
+		while (!try_put(std::move(x))) {
+			std::this_thread::yield();
+		}
+	}
+
+	// move all ready items to `pv`, consumer only
+	size_t try_take_all(std::vector<T>* pv) {
+		size_t n = 0;
+		size_t head = head_.load(std::memory_order_relaxed);
+		for (;;) {
+			Slot* slot = &slots_[head & mask_];
+			if (slot->seq.load(std::memory_order_acquire) != head + 1) {
+				break;
+			}
+			pv->push_back(std::move(slot->value));
+			slot->value = T();
+			slot->seq.store(head + mask_ + 1, std::memory_order_release);
+			head++;
+			n++;
+		}
+		head_.store(head, std::memory_order_relaxed);
+		return n;
+	}
+
+	// blocks until at least one item is taken, consumer only
+	size_t take_all(std::vector<T>* pv) {
+		for (;;) {
+			size_t n = try_take_all(pv);
+			if (n) {
+				return n;
+			}
+
+			sleeping_.store(true, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			{
+				std::unique_lock<std::mutex> _lock(mutex_);
+				cond_.wait(_lock, [this] { return ready(); });
+			}
+			sleeping_.store(false, std::memory_order_relaxed);
+		}
+	}
+
+	size_t size() const {
+		return tail_.load(std::memory_order_relaxed) - head_.load(std::memory_order_relaxed);
+	}
+
+private:
+	struct Slot {
+		std::atomic<size_t> seq;
+		T value;
+	};
+
+	static size_t round_up(size_t n) {
+		size_t cap = 2;
+		while (cap < n) cap <<= 1;
+		return cap;
+	}
+
+	bool ready() const {
+		size_t head = head_.load(std::memory_order_relaxed);
+		return slots_[head & mask_].seq.load(std::memory_order_acquire) == head + 1;
+	}
+
+private:
+	const size_t mask_;
+	std::unique_ptr<Slot[]> slots_;
+	alignas(64) std::atomic<size_t> tail_{0};
+	alignas(64) std::atomic<size_t> head_{0};  // written by the consumer only
+	std::atomic<bool> sleeping_{false};
+	std::mutex mutex_;
+	std::condition_variable cond_;
+};
+
+#endif  // _MPSC_QUEUE_H_
@@ -0,0 +1,93 @@
+#include "NotifySocket.h"
+#include "RuntimeError.h"
+
+#include <stdio.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+
+NotifySocket::NotifySocket(Callback cb)
+	: fd_(-1), callback_(cb)
+{
+	fd_ = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd_ < 0) {
+		throw RuntimeError("socket failed");
+	}
+	int on = 1;
+	if (setsockopt(fd_, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) < 0) {
+		throw RuntimeError("setsockopt SO_PASSCRED failed");
+	}
+
+	// abstract, nothing to clean up on the file system
+	path_ = "@autodeploy/notify/" + std::to_string(getpid());
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path + 1, path_.c_str() + 1, path_.size() - 1);
+	socklen_t len = offsetof(struct sockaddr_un, sun_path) + path_.size();
+	if (bind(fd_, (struct sockaddr*) &addr, len) < 0) {
+		throw RuntimeError("bind " + path_ + " failed ");
+	}
+}
+
+NotifySocket::~NotifySocket()
+{
+	if (fd_ >= 0) {
+		close(fd_);
+	}
+}
+
+void NotifySocket::on_fd_events(int fd, short events)
+{
+	char buffer[4096];
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(struct ucred))];
+	} control;
+
+	for (;;) {  // read until EAGAIN, the fd may be edge triggered
+		struct iovec iov = {buffer, sizeof(buffer) - 1};
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = &control;
+		msg.msg_controllen = sizeof(control);
+
+		ssize_t n = recvmsg(fd_, &msg, MSG_CMSG_CLOEXEC);
+		if (n < 0) {
+			if (errno == EAGAIN) {
+				break;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			throw RuntimeError("recvmsg failed");
+		}
+
+		pid_t pid = 0;
+		for (struct cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+			if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_CREDENTIALS) {
+				struct ucred cred;
+				memcpy(&cred, CMSG_DATA(c), sizeof(cred));
+				pid = cred.pid;
+			} else if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+				// fd store is not supported, don't leak them
+				int* fds = (int*) CMSG_DATA(c);
+				size_t count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+				for (size_t i = 0; i < count; i++) {
+					close(fds[i]);
+				}
+			}
+		}
+		if (pid > 0 && n > 0) {
+			callback_(pid, std::string(buffer, n));
+		}
+	}
+}
+
+int NotifySocket::get_fd()
+{
+	return fd_;
+}
@@ -0,0 +1,33 @@
+#ifndef _NOTIFY_SOCKET_H_
+#define _NOTIFY_SOCKET_H_
+
+#include <string>
+#include <functional>
+#include <sys/types.h>
+
+// sd_notify compatible readiness socket: a unix datagram socket in the
+// abstract namespace, children find it by $NOTIFY_SOCKET and send
+// "READY=1" etc, the sender pid is taken from SCM_CREDENTIALS.
+class NotifySocket
+{
+public:
+	typedef std::function<void(pid_t, std::string)> Callback;
+
+	NotifySocket(Callback cb);
+
+	~NotifySocket();
+
+	// value of $NOTIFY_SOCKET for children
+	const std::string& path() const { return path_; }
+
+	void on_fd_events(int fd, short events);
+
+	int get_fd();
+
+private:
+	int fd_;
+	std::string path_;
+	Callback callback_;
+};
+
+#endif  // _NOTIFY_SOCKET_H_
@@ -0,0 +1,295 @@
+#include "OutputLog.h"
+#include "EpollPoller.h"
+#include "RuntimeError.h"
+#include "Logger.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <algorithm>
+
+using namespace std::placeholders;
+
+const size_t OutputLog::kChunk;
+const size_t OutputLog::kMaxPerWakeup;
+
+OutputLog::OutputLog(const std::string& path, EpollPoller* poller, Metrics* metrics)
+	: path_(path), poller_(poller), timer_fd_(-1), file_(-1), closed_(false),
+	  max_bytes_(0), files_(0), rate_(0), size_(0), tokens_(0), refilled_us_(0),
+	  throttled_(false), tail_pos_(0)
+{
+	pipe_[0] = pipe_[1] = -1;
+	tee_[0] = tee_[1] = -1;
+
+	if (!metrics) {
+		metrics = Metrics::none();
+	}
+	bytes_ = metrics->counter("autodeploy_output_bytes_total", "Bytes of child output written to log files.");
+	throttles_ = metrics->counter("autodeploy_output_throttles_total", "Times child output hit its rate limit.");
+	rotations_ = metrics->counter("autodeploy_output_rotations_total", "Log files of child output rotated.");
+}
+
+OutputLog::~OutputLog()
+{
+	close_fds();
+}
+
+void OutputLog::set_rotation(long max_bytes, int files)
+{
+	max_bytes_ = max_bytes;
+	files_ = files;
+}
+
+void OutputLog::set_rate(long rate)
+{
+	rate_ = rate;
+	tokens_ = rate;  // a second of burst
+	refilled_us_ = Metrics::now_us();
+}
+
+void OutputLog::set_tail(size_t bytes)
+{
+	std::lock_guard<std::mutex> _l(tail_mutex_);
+	tail_.assign(bytes, '\0');
+	tail_pos_ = 0;
+}
+
+void OutputLog::open()
+{
+	try {
+		// the children's end stays blocking, a full pipe slows them down
+		if (pipe2(pipe_, O_CLOEXEC) < 0) {
+			throw RuntimeError("pipe2 failed");
+		}
+		fcntl(pipe_[0], F_SETFL, O_NONBLOCK);
+		fcntl(pipe_[0], F_SETPIPE_SZ, 1 << 20);  // best effort
+		if (tail_.size() && pipe2(tee_, O_CLOEXEC | O_NONBLOCK) < 0) {
+			throw RuntimeError("pipe2 failed");
+		}
+		timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (timer_fd_ < 0) {
+			throw RuntimeError("timerfd_create failed");
+		}
+		if (!open_file(false)) {
+			throw RuntimeError("open " + path_ + " failed: ");
+		}
+	} catch (...) {
+		close_fds();  // not registered yet, `close()` is a no-op then
+		throw;
+	}
+
+	// the poller keeps us alive until the fds are removed
+	auto self = shared_from_this();
+	poller_->add_fd(pipe_[0], std::bind(&OutputLog::on_fd_events, self, _1, _2), EPOLLIN | EPOLLET);
+	poller_->add_fd(timer_fd_, std::bind(&OutputLog::on_timer_events, self, _1, _2), EPOLLIN | EPOLLET);
+}
+
+void OutputLog::close()
+{
+	if (pipe_[0] < 0 || timer_fd_ < 0) {
+		return;
+	}
+	poller_->remove_fd(pipe_[0]);
+	poller_->remove_fd(timer_fd_);
+	// after any drain in progress, which may use them
+	poller_->post(std::bind(&OutputLog::close_fds, shared_from_this()));
+}
+
+std::string OutputLog::tail() const
+{
+	std::lock_guard<std::mutex> _l(tail_mutex_);
+	size_t cap = tail_.size();
+	size_t n = std::min<uint64_t>(tail_pos_, cap);
+	if (!n) {
+		return std::string();
+	}
+	size_t start = (tail_pos_ - n) % cap;
+	std::string s(&tail_[start], std::min(n, cap - start));
+	s.append(&tail_[0], n - s.size());
+	return s;
+}
+
+void OutputLog::on_fd_events(int fd, short events)
+{
+	if (closed_) {
+		return;
+	}
+	size_t moved = 0;
+	while (moved < kMaxPerWakeup) {
+		size_t len = kChunk;
+		if (rate_ > 0) {
+			if (!refill()) {
+				throttle();
+				return;
+			}
+			len = std::min(len, (size_t) tokens_);
+		}
+		ssize_t n = move(len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {  // drained
+			return;
+		}
+		moved += n;
+		tokens_ -= n;
+		size_ += n;
+		bytes_->add(n);
+		if (max_bytes_ > 0 && size_ >= max_bytes_) {
+			rotate();
+		}
+	}
+	// more may be left, let the other fds go first
+	poller_->post(std::bind(&OutputLog::on_fd_events, shared_from_this(), fd, 0));
+}
+
+void OutputLog::on_timer_events(int fd, short events)
+{
+	uint64_t count;
+	if (read(timer_fd_, &count, sizeof(count)) < 0) {
+		return;
+	}
+	throttled_ = false;
+	on_fd_events(pipe_[0], 0);
+}
+
+// move up to `len` bytes from the pipe to the file, and to the tail
+ssize_t OutputLog::move(size_t len)
+{
+	ssize_t n;
+	if (tee_[1] < 0) {
+		n = splice(pipe_[0], NULL, file_, NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n < 0 && errno != EAGAIN && errno != EINTR) {
+			LOGW(Logger::Fields().add("path", path_), "write failed: %s, output dropped", strerror(errno));
+			discard(len);
+			n = len;
+		}
+		return n;
+	}
+
+	// copy to the tee pipe without consuming, then move the same bytes
+	n = tee(pipe_[0], tee_[1], len, SPLICE_F_NONBLOCK);
+	if (n <= 0) {
+		return n;
+	}
+	for (ssize_t done = 0; done < n;) {
+		ssize_t m = splice(pipe_[0], NULL, file_, NULL, n - done, SPLICE_F_MOVE);
+		if (m < 0 && errno == EINTR) {
+			continue;
+		}
+		if (m <= 0) {
+			LOGW(Logger::Fields().add("path", path_), "write failed: %s, output dropped", strerror(errno));
+			discard(n - done);
+			break;
+		}
+		done += m;
+	}
+	append_tail(n);
+	return n;
+}
+
+// read `len` bytes from the tee pipe into the ring
+void OutputLog::append_tail(size_t len)
+{
+	std::lock_guard<std::mutex> _l(tail_mutex_);
+	size_t cap = tail_.size();
+	while (len > 0) {
+		size_t at = tail_pos_ % cap;
+		ssize_t n = read(tee_[0], &tail_[at], std::min(len, cap - at));
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		tail_pos_ += n;
+		len -= n;
+	}
+}
+
+// drop `len` bytes of the pipe, when the file can't take them
+void OutputLog::discard(size_t len)
+{
+	char buf[4096];
+	while (len > 0) {
+		ssize_t n = read(pipe_[0], buf, std::min(len, sizeof(buf)));
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		len -= n;
+	}
+}
+
+// the least budget worth a move, a tenth of a second of it, so a
+// throttled pipe isn't drained by many tiny moves
+double OutputLog::quantum() const
+{
+	return std::min((double) kChunk, std::max(rate_ / 10.0, 1.0));
+}
+
+// add the budget earned since the last refill, true if a quantum is left
+bool OutputLog::refill()
+{
+	uint64_t now = Metrics::now_us();
+	tokens_ = std::min((double) rate_, tokens_ + (now - refilled_us_) * rate_ / 1e6);
+	refilled_us_ = now;
+	return tokens_ >= quantum();
+}
+
+// leave the pipe until a quantum of budget is earned
+void OutputLog::throttle()
+{
+	if (!throttled_) {
+		throttled_ = true;
+		throttles_->add();
+	}
+	double need = quantum() - tokens_;
+	long us = std::max(1000L, (long) (need * 1e6 / rate_));
+	struct itimerspec its = {{0, 0}, {0, 0}};
+	its.it_value.tv_sec = us / 1000000;
+	its.it_value.tv_nsec = us % 1000000 * 1000;
+	timerfd_settime(timer_fd_, 0, &its, NULL);
+}
+
+bool OutputLog::open_file(bool truncate)
+{
+	file_ = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0644);
+	if (file_ < 0) {
+		return false;
+	}
+	// splice() doesn't write O_APPEND files, write at the end instead
+	size_ = lseek(file_, 0, SEEK_END);
+	return true;
+}
+
+// path -> path.1 -> path.2 ..., the oldest is overwritten
+void OutputLog::rotate()
+{
+	::close(file_);
+	if (files_ > 0) {
+		for (int i = files_ - 1; i > 0; i--) {
+			rename((path_ + "." + std::to_string(i)).c_str(), (path_ + "." + std::to_string(i + 1)).c_str());
+		}
+		rename(path_.c_str(), (path_ + ".1").c_str());
+	}
+	if (!open_file(files_ == 0)) {
+		// the output is dropped until the next rotation
+		LOGE(Logger::Fields().add("path", path_), "reopen failed: %s", strerror(errno));
+		size_ = 0;
+	}
+	rotations_->add();
+}
+
+void OutputLog::close_fds()
+{
+	closed_ = true;
+	for (int* fd: {&pipe_[0], &pipe_[1], &tee_[0], &tee_[1], &timer_fd_, &file_}) {
+		if (*fd >= 0) {
+			::close(*fd);
+			*fd = -1;
+		}
+	}
+}
@@ -0,0 +1,98 @@
+#ifndef _OUTPUT_LOG_H_
+#define _OUTPUT_LOG_H_
+
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "Metrics.h"
+
+class EpollPoller;
+
+// Captures the stdout and stderr of the processes of a service.
+//
+// The processes write to one pipe, drained by the loop thread of `poller`
+// with splice() into a log file, so the output isn't copied through user
+// space. The file is rotated at a size, keeping a few old ones.
+//
+// With a tail size, the output is also tee()'d to a second pipe and kept
+// in a ring buffer, to show what a crashed process said last.
+//
+// A chatty service can't stall the loop: at most `kMaxPerWakeup` bytes are
+// moved per wakeup, and with a rate limit the pipe is left alone until the
+// budget refills. A full pipe then blocks the writers, not us.
+class OutputLog : public std::enable_shared_from_this<OutputLog>
+{
+public:
+	OutputLog(const std::string& path, EpollPoller* poller, Metrics* metrics = nullptr);
+
+	~OutputLog();
+
+	// rotate at `max_bytes` keeping `files` old files as path.1, path.2, ...,
+	// or truncate if 0 files, 0 bytes for no rotation
+	void set_rotation(long max_bytes, int files);
+
+	// bytes per second, 0 for unlimited
+	void set_rate(long rate);
+
+	// bytes of output kept in memory, 0 for none
+	void set_tail(size_t bytes);
+
+	// open the file and the pipe, and register to the poller
+	void open();
+
+	// unregister, the fds are closed in the loop thread
+	void close();
+
+	// the write end of the pipe, for the children's stdout and stderr
+	int write_fd() const { return pipe_[1]; }
+
+	// the last output, at most the tail size
+	std::string tail() const;
+
+	const std::string& path() const { return path_; }
+
+	static const size_t kChunk = 64 * 1024;
+	static const size_t kMaxPerWakeup = 256 * 1024;
+
+private:
+	void on_fd_events(int fd, short events);
+	void on_timer_events(int fd, short events);
+	ssize_t move(size_t len);
+	void append_tail(size_t len);
+	void discard(size_t len);
+	double quantum() const;
+	bool refill();
+	void throttle();
+	bool open_file(bool truncate);
+	void rotate();
+	void close_fds();
+
+private:
+	std::string path_;
+	EpollPoller* poller_;
+	int pipe_[2];
+	int tee_[2];     // for the tail
+	int timer_fd_;   // wakes a throttled drain
+	int file_;
+	bool closed_;    // loop thread only from here on
+	long max_bytes_;
+	int files_;
+	long rate_;
+	long size_;      // of the current file
+	double tokens_;  // bytes we may move now, at most `rate_`
+	uint64_t refilled_us_;
+	bool throttled_;
+
+	mutable std::mutex tail_mutex_;
+	std::vector<char> tail_;  // ring buffer
+	uint64_t tail_pos_;       // bytes written to it so far
+
+	Metrics::Counter* bytes_;
+	Metrics::Counter* throttles_;
+	Metrics::Counter* rotations_;
+};
+
+#endif  // _OUTPUT_LOG_H_
@@ -0,0 +1,311 @@
+#include "PollingWatcher.h"
+#include "RuntimeError.h"
+
+#include <unistd.h>
+#include <sys/vfs.h>
+#include <sys/timerfd.h>
+#include <tuple>
+#include <chrono>
+#include <algorithm>
+
+using namespace std::chrono;
+
+// a scan may take at most 1/kCostRatio of the time
+static const long kCostRatio = 20;
+
+// filesystems changed behind the back of the local kernel
+static const unsigned long kRemoteFsTypes[] = {
+	0x6969,      // NFS
+	0x517B,      // SMB
+	0xFF534D42,  // CIFS
+	0xFE534D42,  // SMB2
+	0x65735546,  // FUSE
+	0x01021997,  // 9P
+	0x00C36400,  // Ceph
+	0x5346414F,  // AFS
+	0x73757245,  // Coda
+};
+
+const long PollingWatcher::kMinIntervalMs;
+const long PollingWatcher::kMaxIntervalMs;
+
+PollingWatcher::PollingWatcher(Callback cb, size_t threads, Metrics* metrics)
+	: poll_due_(false),
+	  stop_(false),
+	  running_(false),
+	  default_cb_(cb),
+	  scanner_(threads),
+	  next_handle_(1),
+	  min_ms_(kMinIntervalMs),
+	  max_ms_(kMaxIntervalMs),
+	  interval_ms_(kMinIntervalMs)
+{
+	fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd_ < 0) {
+		throw RuntimeError("timerfd_create failed");
+	}
+
+	if (!metrics) {
+		metrics = Metrics::none();
+	}
+	events_ = metrics->counter("autodeploy_fs_events_total{backend=\"poll\"}", "Filesystem events seen.");
+	scan_time_ = metrics->histogram("autodeploy_poll_scan_seconds", "Time to rescan all polled trees.");
+	metrics->gauge("autodeploy_fs_watches{backend=\"poll\"}", "Watched directories or trees.", [this] {
+		return (double) watch_count();
+	});
+}
+
+PollingWatcher::~PollingWatcher()
+{
+	{
+		std::lock_guard<std::mutex> _l(poll_mutex_);
+		stop_ = true;
+	}
+	poll_cond_.notify_one();
+	if (poll_thread_.joinable()) {
+		poll_thread_.join();
+	}
+	if (fd_ >= 0) {
+		close(fd_);
+	}
+}
+
+int PollingWatcher::add_watch(std::string path, uint32_t mask)
+{
+	return add_watch(path, mask, default_cb_);
+}
+
+int PollingWatcher::add_watch(std::string path, uint32_t mask, Callback cb)
+{
+	bool recursive = mask & fsevent::RECURSIVE;
+	{
+		std::lock_guard<std::mutex> _l(mutex_);
+		auto it = trees_.find(path);
+		if (it != trees_.end() && (it->second.recursive || !recursive)) {
+			int handle = next_handle_++;
+			it->second.subs.push_back(handle);
+			subs_[handle] = Subscription{path, mask, std::make_shared<Callback>(std::move(cb))};
+			return handle;
+		}
+	}
+
+	// the first listing, changes are reported against it
+	TreeScanner::Listing listing;
+	scanner_.scan(std::vector<std::string>(1, path), &listing, recursive);
+
+	std::lock_guard<std::mutex> _l(mutex_);
+	bool idle = trees_.empty();
+	Tree& tree = trees_[path];
+	tree.recursive = tree.recursive || recursive;
+	tree.listing.swap(listing);
+	int handle = next_handle_++;
+	tree.subs.push_back(handle);
+	subs_[handle] = Subscription{path, mask, std::make_shared<Callback>(std::move(cb))};
+	if (idle) {
+		start_polling();
+		interval_ms_ = min_ms_;
+		arm(interval_ms_);
+	}
+	return handle;
+}
+
+bool PollingWatcher::remove_watch(int handle)
+{
+	std::lock_guard<std::mutex> _l(mutex_);
+	auto it = subs_.find(handle);
+	if (it == subs_.end()) {
+		return false;
+	}
+	auto tit = trees_.find(it->second.path);
+	subs_.erase(it);
+	if (tit != trees_.end()) {
+		auto& subs = tit->second.subs;
+		subs.erase(std::remove(subs.begin(), subs.end(), handle), subs.end());
+		if (subs.empty()) {
+			trees_.erase(tit);
+		}
+	}
+	if (trees_.empty()) {
+		arm(0);
+		stop_polling();
+	}
+	return true;
+}
+
+int PollingWatcher::get_fd()
+{
+	return fd_;
+}
+
+void PollingWatcher::on_fd_events(int fd, short events)
+{
+	uint64_t expirations;
+	if (read(fd_, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+		throw RuntimeError("read timerfd failed");
+	}
+	{
+		std::lock_guard<std::mutex> _l(poll_mutex_);
+		poll_due_ = true;
+	}
+	poll_cond_.notify_one();
+}
+
+// the first path is polled, `mutex_` must be held
+void PollingWatcher::start_polling()
+{
+	std::lock_guard<std::mutex> _l(poll_mutex_);
+	stop_ = false;  // the thread may not have seen it yet
+	if (running_) {
+		return;
+	}
+	if (poll_thread_.joinable()) {
+		poll_thread_.join();  // exited, or about to
+	}
+	running_ = true;
+	poll_thread_ = std::thread(std::bind(&PollingWatcher::run, this));
+}
+
+// the last path isn't polled any more, `mutex_` must be held, may be
+// called by a callback in the poll thread, so it doesn't wait for it
+void PollingWatcher::stop_polling()
+{
+	{
+		std::lock_guard<std::mutex> _l(poll_mutex_);
+		stop_ = true;
+	}
+	poll_cond_.notify_one();
+}
+
+void PollingWatcher::run()
+{
+	std::unique_lock<std::mutex> lock(poll_mutex_);
+	for (;;) {
+		poll_cond_.wait(lock, [this] { return poll_due_ || stop_; });
+		if (stop_) {
+			running_ = false;
+			return;
+		}
+		poll_due_ = false;
+		lock.unlock();
+		poll();
+		lock.lock();
+	}
+}
+
+size_t PollingWatcher::watch_count()
+{
+	std::lock_guard<std::mutex> _l(mutex_);
+	return trees_.size();
+}
+
+void PollingWatcher::set_interval(long min_ms, long max_ms)
+{
+	std::lock_guard<std::mutex> _l(mutex_);
+	min_ms_ = std::max(1L, min_ms);
+	max_ms_ = std::max(min_ms_, max_ms);
+	interval_ms_ = min_ms_;
+}
+
+long PollingWatcher::interval_ms() const
+{
+	std::lock_guard<std::mutex> _l(mutex_);
+	return interval_ms_;
+}
+
+bool PollingWatcher::needs_polling(const std::string& path)
+{
+	struct statfs st;
+	if (statfs(path.c_str(), &st) < 0) {
+		return false;
+	}
+	for (unsigned long type: kRemoteFsTypes) {
+		if ((unsigned long) st.f_type == type) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// in the poll thread: rescan every tree, report what differs from the
+// last listing, and pick the next interval from the changes and the scan time.
+void PollingWatcher::poll()
+{
+	std::vector<std::pair<std::string, bool>> paths;
+	{
+		std::lock_guard<std::mutex> _l(mutex_);
+		for (auto& kv: trees_) {
+			paths.push_back(std::make_pair(kv.first, kv.second.recursive));
+		}
+	}
+	if (paths.empty()) {
+		return;
+	}
+
+	auto start = steady_clock::now();
+	size_t changes = 0;
+	TreeScanner::Listing listing;
+	// called outside the lock, a callback may add or remove watches
+	typedef std::tuple<std::shared_ptr<Callback>, std::string, uint32_t> Delivery;
+	std::vector<Delivery> deliveries;
+	for (auto& p: paths) {
+		const std::string& root = p.first;
+		listing.clear();
+		scanner_.scan(std::vector<std::string>(1, root), &listing, p.second);
+
+		std::lock_guard<std::mutex> _l(mutex_);
+		auto it = trees_.find(root);
+		if (it == trees_.end() || it->second.recursive != p.second) {
+			continue;  // removed, or rescanned by `add_watch()` meanwhile
+		}
+		Tree& tree = it->second;
+		TreeScanner::diff(tree.listing, listing, [&](const std::string& path, TreeScanner::Change change) {
+			changes++;
+			uint32_t emask = change == TreeScanner::CREATED ? fsevent::CREATE | fsevent::MODIFY :
+				change == TreeScanner::MODIFIED ? fsevent::MODIFY : fsevent::DELETE;
+			// an entry of the root itself, for subscriptions not recursive
+			bool direct = path.size() <= root.size() || path.find('/', root.size() + 1) == path.npos;
+			for (int handle: tree.subs) {
+				auto sit = subs_.find(handle);
+				if (sit == subs_.end()) {
+					continue;
+				}
+				const Subscription& sub = sit->second;
+				uint32_t mask = emask & sub.mask;
+				if (mask && (direct || (sub.mask & fsevent::RECURSIVE))) {
+					deliveries.push_back(Delivery(sub.cb, path, mask));
+				}
+			}
+		});
+		tree.listing.swap(listing);
+	}
+	scan_time_->record(duration_cast<microseconds>(steady_clock::now() - start).count());
+	events_->add(changes);
+	for (auto& d: deliveries) {
+		const std::string& path = std::get<1>(d);
+		fsevent::Event event = {path.data(), path.size(), std::get<2>(d)};
+		(*std::get<0>(d))(event);
+	}
+
+	long cost_ms = duration_cast<milliseconds>(steady_clock::now() - start).count();
+	std::lock_guard<std::mutex> _l(mutex_);
+	if (changes) {
+		interval_ms_ = min_ms_;  // more changes are likely to follow
+	} else {
+		interval_ms_ = std::min(max_ms_, interval_ms_ * 3 / 2);
+	}
+	interval_ms_ = std::max(interval_ms_, cost_ms * kCostRatio);
+	if (trees_.size()) {
+		arm(interval_ms_);
+	}
+}
+
+// one shot in `ms`, disarm if 0, `mutex_` must be held
+void PollingWatcher::arm(long ms)
+{
+	struct itimerspec its = {{0, 0}, {0, 0}};
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = ms % 1000 * 1000000;
+	if (timerfd_settime(fd_, 0, &its, NULL) < 0) {
+		throw RuntimeError("timerfd_settime failed");
+	}
+}
@@ -0,0 +1,103 @@
+#ifndef _POLLING_WATCHER_H_
+#define _POLLING_WATCHER_H_
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+
+#include "Metrics.h"
+#include "TreeScanner.h"
+#include "WatchBackend.h"
+
+// Watches paths by scanning them on a timer, for filesystems whose changes
+// inotify doesn't see: NFS and other network filesystems, some FUSE mounts,
+// and volumes written from another mount namespace.
+//
+// Each watched path keeps a compact listing of (inode, size, mtime) of its
+// tree, rescanned with a bounded pool of threads. The timerfd only wakes
+// a poll thread, which scans and calls the callbacks, so a stalled
+// network filesystem never blocks the event loop. The poll thread runs
+// only while some path is polled. The poll interval
+// drops to the minimum after a change, backs off to the maximum while the
+// trees are idle, and stays above a multiple of the scan time, so a big or
+// idle tree costs little CPU.
+class PollingWatcher : public WatchBackend
+{
+public:
+	PollingWatcher(Callback cb, size_t threads = 4, Metrics* metrics = nullptr);
+
+	~PollingWatcher();
+
+	int add_watch(std::string path, uint32_t mask);
+
+	int add_watch(std::string path, uint32_t mask, Callback cb) override;
+
+	bool remove_watch(int handle) override;
+
+	// a timerfd armed to the next poll, its events wake the poll thread
+	int get_fd() override;
+
+	void on_fd_events(int fd, short events) override;
+
+	// number of polled trees
+	size_t watch_count() override;
+
+	void set_interval(long min_ms, long max_ms);
+
+	long interval_ms() const;
+
+	// if `path` is on a filesystem inotify may miss changes of
+	static bool needs_polling(const std::string& path);
+
+	static const long kMinIntervalMs = 250;
+	static const long kMaxIntervalMs = 4000;
+
+private:
+	struct Subscription
+	{
+		std::string path;
+		uint32_t mask;
+		std::shared_ptr<Callback> cb;
+	};
+
+	struct Tree
+	{
+		bool recursive;
+		TreeScanner::Listing listing;  // as of the last poll
+		std::vector<int> subs;         // handles of subscriptions on it
+		Tree() : recursive(false), listing(), subs() {}
+	};
+
+	void run();
+	void poll();
+	void arm(long ms);
+	void start_polling();
+	void stop_polling();
+
+private:
+	int fd_;
+	std::mutex poll_mutex_;
+	std::condition_variable poll_cond_;
+	bool poll_due_;  // under `poll_mutex_`
+	bool stop_;      // under `poll_mutex_`, asks the poll thread to exit
+	bool running_;   // under `poll_mutex_`, the poll thread hasn't exited
+	std::thread poll_thread_;  // joined by the next start
+	Callback default_cb_;
+	TreeScanner scanner_;
+	mutable std::mutex mutex_;
+	int next_handle_;
+	std::map<int, Subscription> subs_;
+	std::map<std::string, Tree> trees_;  // by watched path
+	long min_ms_;
+	long max_ms_;
+	long interval_ms_;
+
+	Metrics::Counter* events_;
+	Metrics::Histogram* scan_time_;
+};
+
+#endif  // _POLLING_WATCHER_H_
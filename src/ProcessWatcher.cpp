@@ -1,21 +1,130 @@
 #include "ProcessWatcher.h"
 #include "RuntimeError.h"
+#include "EpollPoller.h"
+#include "Logger.h"
 
 #include <stdio.h>
+#include <stdexcept>
+#include <algorithm>
 #include <limits.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <poll.h>
 #include <sys/signalfd.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
+#include <pthread.h>
 
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
 
-ProcessWatcher::ProcessWatcher(Callback cb)
+using namespace std::placeholders;
+
+static int pidfd_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static int pidfd_send_signal(int pidfd, int sig)
+{
+#ifdef SYS_pidfd_send_signal
+	return syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+const static size_t kMaxListenFds = 64;
+
+// async-signal-safe, for the vfork child
+static void format_pid(char* buf, pid_t pid)
+{
+	char digits[16];
+	int n = 0;
+	do {
+		digits[n++] = '0' + pid % 10;
+		pid /= 10;
+	} while (pid);
+	while (n) {
+		*buf++ = digits[--n];
+	}
+	*buf = '\0';
+}
+
+// move `fds` to 3, 4, ... without CLOEXEC, and `*errfd` out of the way
+static int move_fds(const std::vector<int>& fds, int* errfd)
+{
+	int n = fds.size();
+	int tmp[kMaxListenFds];
+	// dup above the targets first, so no source is overwritten
+	*errfd = fcntl(*errfd, F_DUPFD_CLOEXEC, 3 + n);
+	for (int i = 0; i < n; i++) {
+		tmp[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, 3 + n);
+		if (tmp[i] < 0 || *errfd < 0) {
+			return -1;
+		}
+	}
+	for (int i = 0; i < n; i++) {
+		if (dup2(tmp[i], 3 + i) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// wait status from the siginfo of waitid()
+static int to_status(const siginfo_t& si)
+{
+	switch (si.si_code) {
+	case CLD_EXITED:
+		return (si.si_status & 0xff) << 8;
+	case CLD_KILLED:
+		return si.si_status & 0x7f;
+	case CLD_DUMPED:
+		return (si.si_status & 0x7f) | 0x80;
+	}
+	return 0;
+}
+
+ProcessWatcher::ProcessWatcher(Callback cb, EpollPoller* poller, Metrics* metrics)
+	: sigfd_(-1), poller_(nullptr)
 {
 	callback_ = cb;
 
+	if (!metrics) {
+		metrics = Metrics::none();
+	}
+	spawns_ = metrics->counter("autodeploy_spawns_total", "Children spawned.");
+	spawn_failures_ = metrics->counter("autodeploy_spawn_failures_total", "Spawns failed, by vfork or exec.");
+	exits_ = metrics->counter("autodeploy_process_exits_total", "Children exited and reaped.");
+	spawn_time_ = metrics->histogram("autodeploy_spawn_seconds", "Time of vfork and exec of a child.");
+	kill_to_exit_ = metrics->histogram("autodeploy_kill_to_exit_seconds",
+		"Time from the first signal sent to a child to its exit.");
+	metrics->gauge("autodeploy_children", "Children alive, or exited and not reaped yet.", [this] {
+		std::lock_guard<std::mutex> _l(mutex_);
+		return (double) infos_.size();
+	});
+
+	if (poller) {
+		int fd = pidfd_open(getpid());
+		if (fd >= 0) {
+			close(fd);
+			poller_ = poller;
+			return;
+		}
+		LOGI("pidfd not supported, fall back to SIGCHLD");
+	}
+
 	sigset_t mask;
 	sigemptyset(&mask);
 	sigaddset(&mask, SIGCHLD);
@@ -36,35 +145,192 @@ ProcessWatcher::~ProcessWatcher()
 	if (sigfd_ >= 0) {
 		close(sigfd_);
 	}
+	for (auto& kv: infos_) {
+		if (kv.second.pidfd >= 0) {
+			close(kv.second.pidfd);
+		}
+	}
+}
+
+ProcessWatcher::Command::Command(std::vector<std::string> args)
+	: args_(args)
+{
+	for (char** e = environ; *e; e++) {
+		env_.push_back(*e);
+	}
+	build();
+}
+
+ProcessWatcher::Command::Command(const Command& other)
+	: args_(other.args_), env_(other.env_), fds_(other.fds_), out_fd_(other.out_fd_),
+	  listen_pid_(other.listen_pid_)
+{
+	build();
+}
+
+ProcessWatcher::Command& ProcessWatcher::Command::operator=(const Command& other)
+{
+	if (this != &other) {
+		args_ = other.args_;
+		env_ = other.env_;
+		fds_ = other.fds_;
+		out_fd_ = other.out_fd_;
+		listen_pid_ = other.listen_pid_;
+		build();
+	}
+	return *this;
+}
+
+void ProcessWatcher::Command::set_env(const std::string& key, const std::string& value)
+{
+	std::string prefix = key + "=";
+	for (auto& e: env_) {
+		if (e.compare(0, prefix.size(), prefix) == 0) {
+			e = prefix + value;
+			build();
+			return;
+		}
+	}
+	env_.push_back(prefix + value);
+	build();
+}
+
+void ProcessWatcher::Command::set_listen_fds(std::vector<int> fds)
+{
+	if (fds.size() > kMaxListenFds) {
+		throw std::invalid_argument("too many listen fds");
+	}
+	fds_ = fds;
+	listen_pid_ = fds.empty() ? "" : "LISTEN_PID=" + std::string(20, '\0');
+	set_env("LISTEN_FDS", std::to_string(fds.size()));
+}
+
+void ProcessWatcher::Command::build()
+{
+	argv_.clear();
+	for (auto& a: args_) {
+		argv_.push_back(const_cast<char*>(a.c_str()));
+	}
+	argv_.push_back(nullptr);
+
+	envp_.clear();
+	for (auto& e: env_) {
+		envp_.push_back(const_cast<char*>(e.c_str()));
+	}
+	if (listen_pid_.size()) {
+		envp_.push_back(&listen_pid_[0]);
+	}
+	envp_.push_back(nullptr);
 }
 
 pid_t ProcessWatcher::spwan_process(std::vector<std::string> args)
 {
-	pid_t pid = fork();
-	if (pid < 0) {
-		perror("fork failed");
-		return pid;
-	} else if (pid > 0) {  // parent
-		std::lock_guard<std::mutex> _l(mutex_);
-		ProcessInfo info;
-		info.args = args;
-		infos_[pid] = info;
-		printf("process %d spawned\n", pid);
-	} else {  // child
-		for (int i = 0; i < args.size(); i++) {
-			printf("  args[%d]: %s\n", i, args[i].c_str());
+	return spwan_process(Command(args));
+}
+
+pid_t ProcessWatcher::spwan_process(const Command& cmd)
+{
+	if (cmd.args().empty()) {
+		errno = EINVAL;
+		return -1;
+	}
+	uint64_t start_us = Metrics::now_us();
+
+	// the exec errno comes back through it, it's closed on a successful exec
+	int err_pipe[2];
+	if (pipe2(err_pipe, O_CLOEXEC) < 0) {
+		throw RuntimeError("pipe2 failed");
+	}
+
+	// no signal handler may run in the child, it shares our memory and stack
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	// held until the child is in `infos_`, so the reaper can't miss it
+	std::unique_lock<std::mutex> lock(mutex_);
+	char* const* argv = cmd.argv();
+	char* const* envp = cmd.envp();
+	pid_t pid = vfork();
+	if (pid == 0) {  // child, only async-signal-safe calls until exec
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = SIG_DFL;
+		for (int sig = 1; sig < NSIG; sig++) {
+			sigaction(sig, &sa, NULL);
 		}
+		sigset_t none;
+		sigemptyset(&none);
+		sigprocmask(SIG_SETMASK, &none, NULL);
+		setpgid(0, 0);
+
+		int errfd = err_pipe[1];
+		if (cmd.out_fd_ >= 0 && (dup2(cmd.out_fd_, 1) < 0 || dup2(cmd.out_fd_, 2) < 0)) {
+			int err = errno;
+			write(errfd, &err, sizeof(err));
+			_exit(127);
+		}
+		if (cmd.fds_.size()) {
+			format_pid(&cmd.listen_pid_[strlen("LISTEN_PID=")], getpid());
+			if (move_fds(cmd.fds_, &errfd) < 0) {
+				int err = errno;
+				write(errfd < 0 ? err_pipe[1] : errfd, &err, sizeof(err));
+				_exit(127);
+			}
+		}
+
+		execve(argv[0], argv, envp);
+		int err = errno;
+		write(errfd, &err, sizeof(err));
+		_exit(127);
+	}
+	int err = errno;
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	close(err_pipe[1]);
+
+	if (pid < 0) {
+		close(err_pipe[0]);
+		LOGE("vfork failed: %s", strerror(err));
+		errno = err;
+		spawn_failures_->add();
+		return -1;
+	}
+
+	// the child has exec'ed or exited when vfork returns
+	ssize_t n;
+	do {
+		n = read(err_pipe[0], &err, sizeof(err));
+	} while (n < 0 && errno == EINTR);
+	close(err_pipe[0]);
+	if (n == sizeof(err)) {
+		waitpid(pid, NULL, 0);  // may be reaped by `reap_all()` already
+		LOGE("exec %s failed: %s", argv[0], strerror(err));
+		spawn_failures_->add();
+		errno = err;
+		return -1;
+	}
 
-		std::vector<char*> cargs;
-		for (int i = 0; i < args.size(); i++) {
-			cargs.push_back(const_cast<char*>(args[i].c_str()));
+	ProcessInfo info;
+	info.args = cmd.args();
+	info.spawned_us = Metrics::now_us();
+	if (poller_) {
+		// the child isn't reaped until its pidfd is readable, so it can't be reused
+		info.pidfd = pidfd_open(pid);
+		if (info.pidfd < 0) {
+			throw RuntimeError("pidfd_open failed");
 		}
+		fcntl(info.pidfd, F_SETFD, FD_CLOEXEC);
+	}
+	int pidfd = info.pidfd;
+	infos_[pid] = std::move(info);
+	lock.unlock();
+	spawns_->add();
+	spawn_time_->record(Metrics::now_us() - start_us);
 
-		printf("prepare to exec %s... in %d\n", cargs[0], getpid());
-		execve(cargs[0], &cargs[0], environ);
-		throw RuntimeError("exec failed! " + args[0]);
-		return -1; // NEVER RUNS HERE
+	if (poller_) {
+		poller_->add_fd(pidfd, std::bind(&ProcessWatcher::on_pidfd_events, this, pid, _1, _2));
 	}
+	LOGD("process %d spawned", pid);
 	return pid;
 }
 
@@ -73,48 +339,136 @@ bool ProcessWatcher::kill_process(pid_t pid, int sig)
 	std::lock_guard<std::mutex> _l(mutex_);
 	auto it = infos_.find(pid);
 	if (it != infos_.end()) {
-		if (kill(pid, sig) < 0) {
+		int pidfd = it->second.pidfd;
+		if ((pidfd >= 0 ? pidfd_send_signal(pidfd, sig) : kill(pid, sig)) < 0) {
+			if (errno == ESRCH) {  // exited, not reaped yet
+				return false;
+			}
 			throw RuntimeError("kill failed");
 		}
+		if (!it->second.killed_us) {
+			it->second.killed_us = Metrics::now_us();
+		}
 		return true;
 	}
 	return false;
 }
 
+bool ProcessWatcher::kill_group(pid_t pgid, int sig)
+{
+	// a pgid isn't reused while the group has a member
+	if (pgid <= 1 || kill(-pgid, sig) < 0) {
+		return false;
+	}
+	signaled(pgid);
+	return true;
+}
+
+// remember when a child was first signaled, for the kill to exit latency
+void ProcessWatcher::signaled(pid_t pid)
+{
+	std::lock_guard<std::mutex> _l(mutex_);
+	auto it = infos_.find(pid);
+	if (it != infos_.end() && !it->second.killed_us) {
+		it->second.killed_us = Metrics::now_us();
+	}
+}
+
+bool ProcessWatcher::group_alive(pid_t pgid)
+{
+	return pgid > 1 && (kill(-pgid, 0) == 0 || errno == EPERM);
+}
+
 void ProcessWatcher::run()
 {
-	int flags = fcntl(sigfd_, F_GETFL);
-	if (flags & O_NONBLOCK) {
-		flags &= ~O_NONBLOCK;
-		fcntl(sigfd_, F_SETFL, flags);
+	if (sigfd_ < 0) {
+		throw RuntimeError("run() needs the SIGCHLD backend");
 	}
 	for (;;) {
-		on_fd_events(sigfd_, 0);
+		struct pollfd pfd = {sigfd_, POLLIN, 0};
+		if (poll(&pfd, 1, -1) > 0) {
+			on_fd_events(sigfd_, pfd.revents);
+		}
 	}
 }
 
 void ProcessWatcher::on_fd_events(int fd, short events)
 {
 	struct signalfd_siginfo ssi;
-	long nbytes = read(sigfd_, &ssi, sizeof(ssi));
-	if (nbytes < 0) {
-		throw RuntimeError("read signalfd failed!");
+	for (;;) {  // read until EAGAIN, the fd may be edge triggered
+		long nbytes = read(sigfd_, &ssi, sizeof(ssi));
+		if (nbytes < 0) {
+			if (errno == EAGAIN) {
+				break;
+			}
+			throw RuntimeError("read signalfd failed!");
+		}
+		LOGD("got signal `%s` from %d", strsignal(ssi.ssi_signo), ssi.ssi_pid);
+	}
+
+	// SIGCHLDs coalesce, one may stand for many exited children
+	reap_all();
+}
+
+void ProcessWatcher::reap_all()
+{
+	for (;;) {
+		ProcessInfo info;
+		pid_t pid = wait4(-1, &info.status, WNOHANG, &info.rusage);
+		if (pid == 0) {
+			break;
+		}
+		if (pid < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == ECHILD) {
+				break;
+			}
+			throw RuntimeError("wait failed");
+		}
+
+		int status = info.status;
+		struct rusage rusage = info.rusage;
+		if (take_info(pid, &info)) {
+			info.status = status;
+			info.rusage = rusage;
+			callback_(pid, info);
+		}
 	}
-	pid_t pid = ssi.ssi_pid;
-	printf("got signal `%s` from %d\n", strsignal(ssi.ssi_signo), pid);
+}
+
+void ProcessWatcher::on_pidfd_events(pid_t pid, int fd, short events)
+{
+	siginfo_t si;
+	struct rusage rusage;
+	memset(&si, 0, sizeof(si));
+	memset(&rusage, 0, sizeof(rusage));
 
-	int status = 0;
-	struct rusage rus;
-	memset(&rus, 0, sizeof(rus));
-	if (wait4(pid, &status, WNOHANG, &rus) < 0) {
-		throw RuntimeError("wait failed");
+	// the raw syscall, glibc's waitid() has no rusage
+	if (syscall(SYS_waitid, P_PIDFD, fd, &si, WEXITED | WNOHANG, &rusage) < 0) {
+		if (errno == EINTR) {
+			return;
+		}
+		throw RuntimeError("waitid failed");
 	}
+	if (si.si_pid == 0) {  // not exited yet
+		return;
+	}
+	LOGD("process %d reaped", pid);
 
-	// make sure call `callback_` without effect of `mutex_`
-	auto info = get_info(pid);
-	if (info) {
-		callback_(pid, *info);
+	ProcessInfo info;
+	if (take_info(pid, &info)) {
+		info.status = to_status(si);
+		info.siginfo = si;
+		info.rusage = rusage;
 	}
+	poller_->remove_fd(fd);
+	close(fd);
+	info.pidfd = -1;
+
+	// make sure call `callback_` without effect of `mutex_`
+	callback_(pid, info);
 }
 
 int ProcessWatcher::get_fd()
@@ -122,12 +476,25 @@ int ProcessWatcher::get_fd()
 	return sigfd_;
 }
 
-ProcessWatcher::ProcessInfo* ProcessWatcher::get_info(pid_t pid)
+bool ProcessWatcher::use_pidfd() const
+{
+	return poller_ != nullptr;
+}
+
+// move the info of an exited child out of `infos_`
+bool ProcessWatcher::take_info(pid_t pid, ProcessInfo* info)
 {
 	std::lock_guard<std::mutex> _l(mutex_);
 	auto it = infos_.find(pid);
-	if (it != infos_.end()) {
-		return &it->second;
+	if (it == infos_.end()) {
+		return false;
+	}
+	*info = std::move(it->second);
+	infos_.erase(it);
+	exits_->add();
+	if (info->killed_us) {
+		uint64_t now = Metrics::now_us();
+		kill_to_exit_->record(now - std::min(now, info->killed_us));
 	}
-	return nullptr;
+	return true;
 }
@@ -2,6 +2,7 @@
 #define _PROCESS_WATCHER_H_
 
 #include <unistd.h>
+#include <string.h>
 #include <signal.h>
 #include <sys/wait.h>
 #include <sys/resource.h>
@@ -11,6 +12,16 @@
 #include <mutex>
 #include <functional>
 
+#include "Metrics.h"
+
+class EpollPoller;
+
+// Spawns children and reports their exits.
+//
+// With a poller and a kernel supporting pidfd (5.3+), every child gets a
+// pidfd registered to the poller and is reaped by `waitid(P_PIDFD)`, so no
+// exit is lost however many die at once. Otherwise SIGCHLD is read from a
+// signalfd, and all exited children are reaped per wakeup.
 class ProcessWatcher
 {
 public:
@@ -19,36 +30,104 @@ public:
 		siginfo_t siginfo;
 		struct rusage rusage;
 		std::vector<std::string> args;
+		int pidfd;
+		uint64_t spawned_us;
+		uint64_t killed_us;  // first signal sent by us, 0 if none
 
-		ProcessInfo() {}
+		ProcessInfo() : status(0), args(), pidfd(-1), spawned_us(0), killed_us(0) {
+			memset(&siginfo, 0, sizeof(siginfo));
+			memset(&rusage, 0, sizeof(rusage));
+		}
 		ProcessInfo(const ProcessInfo&) = default;
 		ProcessInfo& operator=(const ProcessInfo&) = default;
 	};
 
+	// argv and envp of a command, built once and reused by every spawn,
+	// so the spawned child doesn't allocate before exec.
+	class Command {
+	public:
+		Command() {}
+		explicit Command(std::vector<std::string> args);
+		Command(const Command& other);
+		Command& operator=(const Command& other);
+
+		// add or replace an environment variable
+		void set_env(const std::string& key, const std::string& value);
+
+		// pass `fds` as fd 3, 4, ... with LISTEN_FDS and LISTEN_PID set
+		void set_listen_fds(std::vector<int> fds);
+
+		const std::vector<int>& listen_fds() const { return fds_; }
+
+		// dup `fd` as stdout and stderr, -1 to inherit ours
+		void set_output(int fd) { out_fd_ = fd; }
+
+		const std::vector<std::string>& args() const { return args_; }
+		char* const* argv() const { return &argv_[0]; }
+		char* const* envp() const { return &envp_[0]; }
+
+	private:
+		void build();
+
+	private:
+		std::vector<std::string> args_;
+		std::vector<std::string> env_;  // snapshot of `environ`
+		std::vector<char*> argv_;       // NULL terminated
+		std::vector<char*> envp_;       // NULL terminated
+		std::vector<int> fds_;
+		int out_fd_ = -1;
+		// "LISTEN_PID=<pid>", filled by the vfork child, which shares our memory
+		mutable std::string listen_pid_;
+		friend class ProcessWatcher;
+	};
+
 	typedef std::function<void(pid_t, const ProcessInfo&)> Callback;
 
-	ProcessWatcher(Callback cb);
+	ProcessWatcher(Callback cb, EpollPoller* poller = nullptr, Metrics* metrics = nullptr);
 
 	~ProcessWatcher();
 
 	pid_t spwan_process(std::vector<std::string> args);
 
+	// vfork and exec, return -1 with errno set if the exec failed
+	pid_t spwan_process(const Command& cmd);
+
 	bool kill_process(pid_t pid, int sig = SIGTERM);
 
+	// every child leads its own process group, signal the whole group,
+	// grandchildren included, even after the child itself exited.
+	bool kill_group(pid_t pgid, int sig = SIGTERM);
+
+	// false once every process of the group exited and was reaped
+	bool group_alive(pid_t pgid);
+
 	void on_fd_events(int fd, short events);
 
+	// the signalfd, or -1 if children are tracked by pidfds
 	int get_fd();
 
+	bool use_pidfd() const;
+
 	void run();
 
 private:
-	ProcessInfo* get_info(pid_t pid);
+	void on_pidfd_events(pid_t pid, int fd, short events);
+	void reap_all();
+	bool take_info(pid_t pid, ProcessInfo* info);
+	void signaled(pid_t pid);
 
 private:
 	int sigfd_;
+	EpollPoller* poller_;  // not null if use pidfd
 	Callback callback_;
 	std::map<pid_t, ProcessInfo> infos_;
 	mutable std::mutex mutex_;
+
+	Metrics::Counter* spawns_;
+	Metrics::Counter* spawn_failures_;
+	Metrics::Counter* exits_;
+	Metrics::Histogram* spawn_time_;
+	Metrics::Histogram* kill_to_exit_;
 };
 
 #endif  // _PROCESS_WATCHER_H_
\ No newline at end of file
@@ -3,6 +3,8 @@
 
 #include <errno.h>
 #include <string.h>
+#include <string>
+#include <stdexcept>
 
 struct RuntimeError : public std::runtime_error
 {
@@ -0,0 +1,219 @@
+#include "ServiceConfig.h"
+
+#include <fstream>
+#include <stdexcept>
+#include <stdlib.h>
+
+static std::string trim(const std::string& s)
+{
+	const char* blanks = " \t\r\n";
+	size_t begin = s.find_first_not_of(blanks);
+	if (begin == s.npos) {
+		return "";
+	}
+	size_t end = s.find_last_not_of(blanks);
+	return s.substr(begin, end - begin + 1);
+}
+
+static std::string resolve(const std::string& dir, const std::string& path)
+{
+	if (dir.empty() || path.empty() || path[0] == '/') {
+		return path;
+	}
+	return dir + "/" + path;
+}
+
+static long to_long(const std::string& key, const std::string& value)
+{
+	char* end = nullptr;
+	long v = strtol(value.c_str(), &end, 10);
+	if (value.empty() || *end || v < 0) {
+		throw std::invalid_argument("bad value of " + key + ": " + value);
+	}
+	return v;
+}
+
+static bool to_bool(const std::string& key, const std::string& value)
+{
+	if (value == "true" || value == "yes" || value == "1") {
+		return true;
+	}
+	if (value == "false" || value == "no" || value == "0") {
+		return false;
+	}
+	throw std::invalid_argument("bad value of " + key + ": " + value);
+}
+
+std::vector<std::string> ServiceConfig::split_args(const std::string& line)
+{
+	std::vector<std::string> args;
+	std::string arg;
+	bool quoted = false, has_arg = false;
+	for (char c: line) {
+		if (c == '"') {
+			quoted = !quoted;
+			has_arg = true;
+		} else if (!quoted && (c == ' ' || c == '\t')) {
+			if (has_arg) {
+				args.push_back(arg);
+				arg.clear();
+				has_arg = false;
+			}
+		} else {
+			arg.push_back(c);
+			has_arg = true;
+		}
+	}
+	if (quoted) {
+		throw std::invalid_argument("unterminated quote: " + line);
+	}
+	if (has_arg) {
+		args.push_back(arg);
+	}
+	return args;
+}
+
+void ServiceConfig::set_option(ServiceSpec* spec, std::string key, std::string value, std::string dir)
+{
+	if (key == "cmd") {
+		spec->args = split_args(value);
+		if (spec->args.empty()) {
+			throw std::invalid_argument("empty cmd");
+		}
+		if (spec->args[0].find('/') != std::string::npos) {
+			spec->args[0] = resolve(dir, spec->args[0]);
+		}
+	} else if (key == "watch") {
+		spec->paths.push_back(resolve(dir, value));
+	} else if (key == "listen") {
+		spec->listens.push_back(value);
+	} else if (key == "quiet_ms") {
+		spec->policy.quiet_ms = to_long(key, value);
+	} else if (key == "max_latency_ms") {
+		spec->policy.max_latency_ms = to_long(key, value);
+	} else if (key == "content_hash") {
+		spec->policy.content_hash = to_bool(key, value);
+	} else if (key == "recursive") {
+		spec->policy.recursive = to_bool(key, value);
+	} else if (key == "watch_mode") {
+		if (value == "auto") {
+			spec->policy.watch_mode = ServicePolicy::WATCH_AUTO;
+		} else if (value == "inotify") {
+			spec->policy.watch_mode = ServicePolicy::WATCH_INOTIFY;
+		} else if (value == "poll") {
+			spec->policy.watch_mode = ServicePolicy::WATCH_POLL;
+		} else {
+			throw std::invalid_argument("bad value of " + key + ": " + value);
+		}
+	} else if (key == "restart") {
+		if (value == "stop_first") {
+			spec->policy.strategy = ServicePolicy::STOP_FIRST;
+		} else if (value == "start_first") {
+			spec->policy.strategy = ServicePolicy::START_FIRST;
+		} else {
+			throw std::invalid_argument("bad value of " + key + ": " + value);
+		}
+	} else if (key == "notify") {
+		spec->policy.notify = to_bool(key, value);
+	} else if (key == "start_timeout_ms") {
+		spec->policy.start_timeout_ms = to_long(key, value);
+	} else if (key == "ready_ms") {
+		spec->policy.ready_ms = to_long(key, value);
+	} else if (key == "stop_timeout_ms") {
+		spec->policy.stop_timeout_ms = to_long(key, value);
+	} else if (key == "backoff_min_ms") {
+		spec->policy.backoff_min_ms = to_long(key, value);
+	} else if (key == "backoff_max_ms") {
+		spec->policy.backoff_max_ms = to_long(key, value);
+	} else if (key == "reset_after_ms") {
+		spec->policy.reset_after_ms = to_long(key, value);
+	} else if (key == "log_file") {
+		spec->policy.log_file = resolve(dir, value);
+	} else if (key == "log_max_bytes") {
+		spec->policy.log_max_bytes = to_long(key, value);
+	} else if (key == "log_files") {
+		spec->policy.log_files = to_long(key, value);
+	} else if (key == "log_rate") {
+		spec->policy.log_rate = to_long(key, value);
+	} else if (key == "tail_bytes") {
+		spec->policy.tail_bytes = to_long(key, value);
+	} else if (key == "health") {
+		spec->policy.health = value;
+		if (value.compare(0, 5, "exec:") == 0) {
+			// resolve the command like `cmd`, keep the args as written
+			std::string line = trim(value.substr(5));
+			size_t end = line.find_first_of(" \t");
+			std::string cmd = line.substr(0, end);
+			if (cmd.find('/') != std::string::npos) {
+				spec->policy.health = "exec:" + resolve(dir, cmd) + (end == line.npos ? "" : line.substr(end));
+			}
+		}
+	} else if (key == "health_interval_ms") {
+		spec->policy.health_interval_ms = to_long(key, value);
+	} else if (key == "health_timeout_ms") {
+		spec->policy.health_timeout_ms = to_long(key, value);
+	} else if (key == "health_failures") {
+		spec->policy.health_failures = to_long(key, value);
+	} else if (key == "priority") {
+		char* end = nullptr;
+		spec->policy.priority = strtol(value.c_str(), &end, 10);
+		if (value.empty() || *end) {
+			throw std::invalid_argument("bad value of " + key + ": " + value);
+		}
+	} else {
+		throw std::invalid_argument("unknown option: " + key);
+	}
+}
+
+std::vector<ServiceSpec> ServiceConfig::load(std::string file)
+{
+	std::ifstream in(file);
+	if (!in) {
+		throw std::runtime_error("open " + file + " failed");
+	}
+	size_t slash = file.rfind('/');
+	std::string dir = slash == file.npos ? "." : file.substr(0, slash);
+
+	std::vector<ServiceSpec> specs;
+	std::string line;
+	for (int lineno = 1; std::getline(in, line); lineno++) {
+		std::string where = file + ":" + std::to_string(lineno) + ": ";
+		size_t hash = line.find('#');
+		if (hash != line.npos) {
+			line.erase(hash);
+		}
+		line = trim(line);
+		if (line.empty()) {
+			continue;
+		}
+
+		if (line[0] == '[') {
+			if (line.back() != ']' || line.size() < 3) {
+				throw std::invalid_argument(where + "bad section: " + line);
+			}
+			specs.push_back(ServiceSpec());
+			specs.back().name = trim(line.substr(1, line.size() - 2));
+			continue;
+		}
+
+		size_t eq = line.find('=');
+		if (eq == line.npos) {
+			throw std::invalid_argument(where + "expect key = value: " + line);
+		}
+		if (specs.empty()) {
+			throw std::invalid_argument(where + "option out of a [service] section");
+		}
+		try {
+			set_option(&specs.back(), trim(line.substr(0, eq)), trim(line.substr(eq + 1)), dir);
+		} catch (const std::invalid_argument& e) {
+			throw std::invalid_argument(where + e.what());
+		}
+	}
+
+	for (auto& spec: specs) {
+		if (spec.args.empty()) {
+			throw std::invalid_argument(file + ": [" + spec.name + "] has no cmd");
+		}
+	}
+	return specs;
+}
@@ -0,0 +1,134 @@
+#ifndef _SERVICE_CONFIG_H_
+#define _SERVICE_CONFIG_H_
+
+#include <string>
+#include <vector>
+
+struct ServicePolicy
+{
+	enum WatchMode {
+		WATCH_AUTO,     // poll paths on filesystems inotify may miss changes of
+		WATCH_INOTIFY,
+		WATCH_POLL,     // scan the trees on a timer
+	};
+
+	enum Strategy {
+		STOP_FIRST,   // kill the old process, then spawn the new one
+		START_FIRST,  // spawn the new process, kill the old one once it's ready
+	};
+
+	// fs events are merged until the tree is quiet for `quiet_ms`,
+	// but restart no later than `max_latency_ms` after the first one.
+	long quiet_ms;
+	long max_latency_ms;
+
+	// restart only if a file content changed, not on `touch` or chmod
+	bool content_hash;
+
+	WatchMode watch_mode;
+
+	// watch the whole trees under the paths, not only their entries
+	bool recursive;
+
+	Strategy strategy;
+
+	// a process is ready when it sends "READY=1" to $NOTIFY_SOCKET if `notify`,
+	// it's killed if not ready in `start_timeout_ms`. Without `notify`, it's
+	// ready if still running after `ready_ms`.
+	bool notify;
+	long start_timeout_ms;
+	long ready_ms;
+
+	// SIGKILL a process not exited `stop_timeout_ms` after SIGTERM
+	long stop_timeout_ms;
+
+	// a crashed process is restarted after a random delay in
+	// [backoff_min_ms, 3 * last delay], at most `backoff_max_ms`,
+	// the delay starts over if it stayed up for `reset_after_ms`.
+	long backoff_min_ms;
+	long backoff_max_ms;
+	long reset_after_ms;
+
+	// services with higher priority restart first when restarts are limited
+	int priority;
+
+	// stdout and stderr go to `log_file` if set, rotated at `log_max_bytes`
+	// keeping `log_files` old files, at most `log_rate` bytes/s if not 0,
+	// and the last `tail_bytes` are kept in memory.
+	std::string log_file;
+	long log_max_bytes;
+	int log_files;
+	long log_rate;
+	long tail_bytes;
+
+	// probe a ready process every `health_interval_ms` if `health` is set,
+	// "tcp://host:port", "http://host:port/path" or "exec:cmd args", and
+	// restart it once `health_failures` probes in a row failed or took
+	// longer than `health_timeout_ms`.
+	std::string health;
+	long health_interval_ms;
+	long health_timeout_ms;
+	int health_failures;
+
+	ServicePolicy() : quiet_ms(200), max_latency_ms(2000), content_hash(false),
+		watch_mode(WATCH_AUTO), recursive(false), strategy(STOP_FIRST), notify(false), start_timeout_ms(10000), ready_ms(1000),
+		stop_timeout_ms(5000), backoff_min_ms(100), backoff_max_ms(64000),
+		reset_after_ms(10000), priority(0), log_file(), log_max_bytes(10 << 20), log_files(3),
+		log_rate(0), tail_bytes(16384), health(), health_interval_ms(5000), health_timeout_ms(1000),
+		health_failures(3) {}
+};
+
+struct ServiceSpec
+{
+	std::string name;
+	std::vector<std::string> args;
+	std::vector<std::string> paths;    // watched paths
+	std::vector<std::string> listens;  // addresses of listening sockets passed to the process
+	ServicePolicy policy;
+};
+
+// Services file, one section per service:
+//
+//     # comment
+//     [web]
+//     cmd = ./web/server --port 8080
+//     watch = ./web            # may be given more than once
+//     quiet_ms = 200
+//     max_latency_ms = 2000
+//     content_hash = true
+//     watch_mode = auto        # or inotify, or poll
+//     recursive = true         # the whole tree, not only its entries
+//     restart = start_first    # or stop_first
+//     notify = true            # wait for READY=1 on $NOTIFY_SOCKET
+//     start_timeout_ms = 10000
+//     ready_ms = 1000          # if not notify
+//     stop_timeout_ms = 5000
+//     backoff_min_ms = 100
+//     backoff_max_ms = 64000
+//     reset_after_ms = 10000
+//     priority = 0
+//     listen = 127.0.0.1:8080  # passed as fd 3, may be given more than once
+//     log_file = ./web.log     # stdout and stderr, inherited if not set
+//     log_max_bytes = 10485760 # rotated at this size
+//     log_files = 3            # web.log.1 ... web.log.3 kept
+//     log_rate = 0             # bytes per second, 0 for unlimited
+//     tail_bytes = 16384       # last output kept in memory
+//     health = http://127.0.0.1:8080/healthz  # or tcp://host:port, or exec:./check.sh
+//     health_interval_ms = 5000
+//     health_timeout_ms = 1000
+//     health_failures = 3      # restart after this many failed in a row
+//
+// relative paths are relative to the directory of the file.
+class ServiceConfig
+{
+public:
+	static std::vector<ServiceSpec> load(std::string file);
+
+	// set option `key` of `spec`, throws std::invalid_argument if bad
+	static void set_option(ServiceSpec* spec, std::string key, std::string value, std::string dir = "");
+
+	// split a command line by white spaces, "double quoted" args kept whole
+	static std::vector<std::string> split_args(const std::string& line);
+};
+
+#endif  // _SERVICE_CONFIG_H_
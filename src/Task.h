@@ -0,0 +1,126 @@
+#ifndef _TASK_H_
+#define _TASK_H_
+
+#include <new>
+#include <cstddef>
+#include <stdint.h>
+#include <utility>
+#include <type_traits>
+
+// A move-only `void()` callable, small functors (up to kInlineSize bytes,
+// e.g. a std::bind of a member function, `this` and a std::string) are
+// stored inline, so building and queueing a Task doesn't allocate.
+class Task
+{
+public:
+	static const size_t kInlineSize = 64;
+
+	Task() : invoke_(nullptr), manage_(nullptr) {}
+
+	template <typename F, typename = typename std::enable_if<
+		!std::is_same<typename std::decay<F>::type, Task>::value>::type>
+	Task(F&& f) : invoke_(nullptr), manage_(nullptr) {
+		typedef typename std::decay<F>::type Functor;
+		init<Functor>(std::forward<F>(f), std::integral_constant<bool, fits<Functor>()>());
+	}
+
+	Task(Task&& other) : invoke_(nullptr), manage_(nullptr) {
+		take(other);
+	}
+
+	Task& operator=(Task&& other) {
+		if (this != &other) {
+			reset();
+			take(other);
+		}
+		return *this;
+	}
+
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+
+	~Task() {
+		reset();
+	}
+
+	void operator()() {
+		invoke_(&storage_);
+	}
+
+	explicit operator bool() const {
+		return invoke_ != nullptr;
+	}
+
+	void reset() {
+		if (manage_) {
+			manage_(&storage_, nullptr);
+		}
+		invoke_ = nullptr;
+		manage_ = nullptr;
+	}
+
+private:
+	typedef typename std::aligned_storage<kInlineSize, alignof(std::max_align_t)>::type Storage;
+
+	template <typename Functor>
+	static constexpr bool fits() {
+		return sizeof(Functor) <= kInlineSize && alignof(std::max_align_t) % alignof(Functor) == 0;
+	}
+
+	// stored inline
+	template <typename Functor, typename F>
+	void init(F&& f, std::true_type) {
+		new (&storage_) Functor(std::forward<F>(f));
+		invoke_ = [](void* p) { (*static_cast<Functor*>(p))(); };
+		// move to `dst` then destroy `src`, or destroy `src` if `dst` is null
+		manage_ = [](void* src, void* dst) {
+			Functor* f = static_cast<Functor*>(src);
+			if (dst) {
+				new (dst) Functor(std::move(*f));
+			}
+			f->~Functor();
+		};
+	}
+
+	// too big, stored on heap
+	template <typename Functor, typename F>
+	void init(F&& f, std::false_type) {
+		*reinterpret_cast<Functor**>(&storage_) = new Functor(std::forward<F>(f));
+		invoke_ = [](void* p) { (**static_cast<Functor**>(p))(); };
+		manage_ = [](void* src, void* dst) {
+			Functor** pf = static_cast<Functor**>(src);
+			if (dst) {
+				*static_cast<Functor**>(dst) = *pf;
+			} else {
+				delete *pf;
+			}
+		};
+	}
+
+	void take(Task& other) {
+		if (other.manage_) {
+			other.manage_(&other.storage_, &storage_);
+		}
+		invoke_ = other.invoke_;
+		manage_ = other.manage_;
+		other.invoke_ = nullptr;
+		other.manage_ = nullptr;
+	}
+
+private:
+	Storage storage_;
+	void (*invoke_)(void*);
+	void (*manage_)(void*, void*);
+};
+
+// a Task with the time it was queued, for the queueing latency
+struct QueuedTask
+{
+	Task task;
+	uint64_t queued_us;
+
+	QueuedTask() : task(), queued_us(0) {}
+	QueuedTask(Task&& t, uint64_t us) : task(std::move(t)), queued_us(us) {}
+};
+
+#endif  // _TASK_H_
@@ -0,0 +1,315 @@
+#include "TreeScanner.h"
+
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <memory>
+#include <algorithm>
+
+static void to_entry(const struct stat& st, TreeScanner::Entry* entry)
+{
+	entry->ino = st.st_ino;
+	entry->size = st.st_size;
+	entry->mtime_ns = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	entry->dir = S_ISDIR(st.st_mode);
+}
+
+// directories waiting to be walked, shared by the threads of one scan
+struct ScanQueue {
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::vector<std::string> dirs;
+	size_t busy;  // threads walking a directory, which may add more
+	bool recursive;
+
+	ScanQueue(bool r) : busy(0), recursive(r) {}
+
+	// return false once all directories are walked
+	bool take(std::string* dir) {
+		std::unique_lock<std::mutex> lock(mutex);
+		cond.wait(lock, [this] { return dirs.size() || !busy; });
+		if (dirs.empty()) {
+			return false;
+		}
+		dir->swap(dirs.back());
+		dirs.pop_back();
+		busy++;
+		return true;
+	}
+
+	void done(std::vector<std::string>* subdirs) {
+		std::lock_guard<std::mutex> _l(mutex);
+		for (auto& d: *subdirs) {
+			dirs.push_back(std::move(d));
+		}
+		subdirs->clear();
+		busy--;
+		cond.notify_all();
+	}
+};
+
+static void walk(ScanQueue* queue, TreeScanner::Listing* found)
+{
+	std::string path;
+	std::vector<std::string> subdirs;
+	while (queue->take(&path)) {
+		DIR* dir = opendir(path.c_str());
+		if (dir) {  // or removed since
+			size_t len = path.size();
+			while (struct dirent* ent = readdir(dir)) {
+				const char* name = ent->d_name;
+				if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) {
+					continue;
+				}
+				struct stat st;
+				if (fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+					continue;
+				}
+				if (path.back() != '/') {
+					path.push_back('/');
+				}
+				path.append(name);
+				TreeScanner::Entry entry;
+				to_entry(st, &entry);
+				found->add(path.data(), path.size(), entry);
+				if (entry.dir && queue->recursive) {
+					subdirs.push_back(path);
+				}
+				path.resize(len);
+			}
+			closedir(dir);
+		}
+		queue->done(&subdirs);
+	}
+}
+
+void TreeScanner::Listing::add(const char* path, size_t len, const Entry& entry)
+{
+	Record r = {paths_.size(), (uint32_t) len, entry};
+	paths_.append(path, len);
+	records_.push_back(r);
+}
+
+void TreeScanner::Listing::append(const Listing& other)
+{
+	size_t base = paths_.size();
+	paths_.append(other.paths_);
+	for (auto r: other.records_) {
+		r.off += base;
+		records_.push_back(r);
+	}
+}
+
+void TreeScanner::Listing::sort()
+{
+	const char* base = paths_.data();
+	std::sort(records_.begin(), records_.end(), [base](const Record& a, const Record& b) {
+		int c = memcmp(base + a.off, base + b.off, std::min(a.len, b.len));
+		return c < 0 || (c == 0 && a.len < b.len);
+	});
+}
+
+void TreeScanner::Listing::clear()
+{
+	paths_.clear();
+	records_.clear();
+}
+
+void TreeScanner::Listing::swap(Listing& other)
+{
+	paths_.swap(other.paths_);
+	records_.swap(other.records_);
+}
+
+size_t TreeScanner::Listing::memory() const
+{
+	return paths_.capacity() + records_.capacity() * sizeof(Record);
+}
+
+const size_t TreeScanner::kMaxThreads;
+const long TreeScanner::kIdleMs;
+
+// a scan in progress, shared with the helpers, which may start after it's done
+struct ScanJob {
+	ScanQueue queue;
+	std::vector<TreeScanner::Listing> found;  // one per thread, merged at the end
+
+	ScanJob(bool recursive, size_t threads) : queue(recursive), found(threads) {}
+};
+
+TreeScanner::TreeScanner(size_t threads)
+	: threads_(threads), stop_(false), idle_(0)
+{
+	if (!threads_) {
+		threads_ = std::thread::hardware_concurrency();
+	}
+	threads_ = std::max<size_t>(1, std::min(threads_, kMaxThreads));
+}
+
+TreeScanner::~TreeScanner()
+{
+	{
+		std::lock_guard<std::mutex> _l(mutex_);
+		stop_ = true;
+	}
+	cond_.notify_all();
+	for (auto& t: pool_) {
+		t.join();
+	}
+}
+
+// a helper, until stopped or idle for `kIdleMs`
+void TreeScanner::run() const
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	for (;;) {
+		idle_++;
+		cond_.wait_for(lock, std::chrono::milliseconds(kIdleMs), [this] { return stop_ || tasks_.size(); });
+		idle_--;
+		if (tasks_.empty()) {
+			break;
+		}
+		std::function<void()> task;
+		task.swap(tasks_.front());
+		tasks_.pop_front();
+		lock.unlock();
+		task();
+		lock.lock();
+	}
+	exited_.push_back(std::this_thread::get_id());
+}
+
+// enough helpers for the queued tasks, `mutex_` must be held
+void TreeScanner::start_helpers() const
+{
+	// the exited ones only need a join
+	for (auto id: exited_) {
+		for (auto it = pool_.begin(); it != pool_.end(); ++it) {
+			if (it->get_id() == id) {
+				it->join();
+				pool_.erase(it);
+				break;
+			}
+		}
+	}
+	exited_.clear();
+
+	size_t running = pool_.size();
+	size_t wanted = tasks_.size() > idle_ ? tasks_.size() - idle_ : 0;
+	for (size_t i = running; i < threads_ - 1 && i < running + wanted; i++) {
+		pool_.push_back(std::thread(std::bind(&TreeScanner::run, this)));
+	}
+}
+
+void TreeScanner::scan(const std::vector<std::string>& roots, Snapshot* snap) const
+{
+	Listing listing;
+	scan(roots, &listing);
+	snap->reserve(snap->size() + listing.size());
+	for (size_t i = 0; i < listing.size(); i++) {
+		(*snap)[std::string(listing.path(i), listing.path_len(i))] = listing.entry(i);
+	}
+}
+
+void TreeScanner::scan(const std::vector<std::string>& roots, Listing* listing, bool recursive) const
+{
+	std::vector<std::string> dirs;
+	for (auto& root: roots) {
+		Entry entry;
+		if (!stat_path(root.c_str(), &entry)) {
+			continue;
+		}
+		listing->add(root.data(), root.size(), entry);
+		if (entry.dir) {
+			dirs.push_back(root);
+		}
+	}
+
+	size_t helpers = dirs.empty() ? 0 : threads_ - 1;
+	auto job = std::make_shared<ScanJob>(recursive, helpers + 1);
+	job->queue.dirs.swap(dirs);
+	if (helpers) {
+		std::lock_guard<std::mutex> _l(mutex_);
+		for (size_t i = 1; i <= helpers; i++) {
+			tasks_.push_back([job, i]() { walk(&job->queue, &job->found[i]); });
+		}
+		start_helpers();
+		cond_.notify_all();
+	}
+
+	// returns once no directory is left and no helper is walking one,
+	// a helper starting later finds nothing to do
+	walk(&job->queue, &job->found[0]);
+	std::lock_guard<std::mutex> _l(job->queue.mutex);
+	for (auto& part: job->found) {
+		listing->append(part);
+	}
+	listing->sort();
+}
+
+bool TreeScanner::stat_path(const char* path, Entry* entry)
+{
+	struct stat st;
+	if (lstat(path, &st) < 0) {
+		return false;
+	}
+	to_entry(st, entry);
+	return true;
+}
+
+void TreeScanner::diff(const Snapshot& before, const Snapshot& after, DiffCallback cb)
+{
+	for (auto& kv: after) {
+		auto it = before.find(kv.first);
+		if (it == before.end() || it->second.ino != kv.second.ino || it->second.dir != kv.second.dir) {
+			cb(kv.first, CREATED);
+		} else if (!kv.second.dir && it->second != kv.second) {
+			cb(kv.first, MODIFIED);
+		}
+	}
+	for (auto& kv: before) {
+		if (!after.count(kv.first)) {
+			cb(kv.first, DELETED);
+		}
+	}
+}
+
+void TreeScanner::diff(const Listing& before, const Listing& after, DiffCallback cb)
+{
+	// a merge of the two sorted listings
+	size_t i = 0, j = 0;
+	while (i < before.size() || j < after.size()) {
+		int c;
+		if (i == before.size()) {
+			c = 1;
+		} else if (j == after.size()) {
+			c = -1;
+		} else {
+			size_t la = before.path_len(i), lb = after.path_len(j);
+			c = memcmp(before.path(i), after.path(j), std::min(la, lb));
+			if (c == 0) {
+				c = la < lb ? -1 : la > lb;
+			}
+		}
+		if (c < 0) {
+			cb(std::string(before.path(i), before.path_len(i)), DELETED);
+			i++;
+		} else if (c > 0) {
+			cb(std::string(after.path(j), after.path_len(j)), CREATED);
+			j++;
+		} else {
+			const Entry& a = before.entry(i);
+			const Entry& b = after.entry(j);
+			if (a.ino != b.ino || a.dir != b.dir) {
+				cb(std::string(after.path(j), after.path_len(j)), CREATED);
+			} else if (!b.dir && a != b) {
+				cb(std::string(after.path(j), after.path_len(j)), MODIFIED);
+			}
+			i++;
+			j++;
+		}
+	}
+}
@@ -0,0 +1,123 @@
+#ifndef _TREE_SCANNER_H_
+#define _TREE_SCANNER_H_
+
+#include <list>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <functional>
+#include <unordered_map>
+#include <condition_variable>
+
+// Snapshots directory trees as (inode, size, mtime) per path.
+//
+// Directories are walked by the calling thread and a pool of helper threads,
+// one directory per task, each entry is stat'ed relative to its directory
+// fd, so a big checkout is scanned in a fraction of the time of a recursive
+// walk. Helpers are started by a scan and exit after `kIdleMs` without one,
+// so a scanner used now and then keeps no threads. A scan doesn't wait for
+// helpers busy with another scan, it walks alone meanwhile.
+class TreeScanner
+{
+public:
+	struct Entry {
+		uint64_t ino;
+		uint64_t size;
+		int64_t mtime_ns;
+		bool dir;
+
+		bool operator==(const Entry& o) const {
+			return ino == o.ino && size == o.size && mtime_ns == o.mtime_ns && dir == o.dir;
+		}
+		bool operator!=(const Entry& o) const { return !(*this == o); }
+	};
+
+	typedef std::unordered_map<std::string, Entry> Snapshot;
+
+	// compact form of a snapshot for trees polled over and over: paths are
+	// packed in one buffer and records sorted by path, about 48 bytes per
+	// file plus its path, and no allocation per file.
+	class Listing
+	{
+	public:
+		size_t size() const { return records_.size(); }
+		const char* path(size_t i) const { return paths_.data() + records_[i].off; }
+		size_t path_len(size_t i) const { return records_[i].len; }
+		const Entry& entry(size_t i) const { return records_[i].entry; }
+
+		void add(const char* path, size_t len, const Entry& entry);
+		void append(const Listing& other);
+		void sort();
+		void clear();
+		void swap(Listing& other);
+
+		// bytes allocated
+		size_t memory() const;
+
+	private:
+		struct Record {
+			size_t off;
+			uint32_t len;
+			Entry entry;
+		};
+
+		std::string paths_;
+		std::vector<Record> records_;
+	};
+
+	enum Change {
+		CREATED,   // or replaced by another inode
+		MODIFIED,
+		DELETED,
+	};
+
+	typedef std::function<void(const std::string&, Change)> DiffCallback;
+
+	// 0 for one thread per CPU, up to kMaxThreads
+	explicit TreeScanner(size_t threads = 0);
+
+	~TreeScanner();
+
+	TreeScanner(const TreeScanner&) = delete;
+	TreeScanner& operator=(const TreeScanner&) = delete;
+
+	// add `roots` and everything under them to `snap`
+	void scan(const std::vector<std::string>& roots, Snapshot* snap) const;
+
+	// same to a sorted listing, only the entries of the roots if not `recursive`
+	void scan(const std::vector<std::string>& roots, Listing* listing, bool recursive = true) const;
+
+	// stat one path, return false if it doesn't exist
+	static bool stat_path(const char* path, Entry* entry);
+
+	// report what differs from `before` to `after`, directories are only
+	// reported when created or deleted, their mtime follows their entries.
+	static void diff(const Snapshot& before, const Snapshot& after, DiffCallback cb);
+
+	static void diff(const Listing& before, const Listing& after, DiffCallback cb);
+
+	static const size_t kMaxThreads = 8;
+	static const long kIdleMs = 5000;
+
+	size_t threads() const { return threads_; }
+
+private:
+	void run() const;
+	void start_helpers() const;
+
+private:
+	size_t threads_;
+	mutable std::mutex mutex_;
+	mutable std::condition_variable cond_;
+	mutable std::deque<std::function<void()>> tasks_;  // helpers of the scans
+	bool stop_;
+	// at most `threads_ - 1`, the caller is one, all under `mutex_`
+	mutable std::list<std::thread> pool_;
+	mutable std::vector<std::thread::id> exited_;  // in `pool_`, to join
+	mutable size_t idle_;  // waiting for a task
+};
+
+#endif  // _TREE_SCANNER_H_
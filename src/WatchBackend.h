@@ -0,0 +1,58 @@
+#ifndef _WATCH_BACKEND_H_
+#define _WATCH_BACKEND_H_
+
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+
+namespace fsevent {
+	enum {
+		ACCESS      = 0x01,
+		ATTRIB      = 0x02,
+		CREATE      = 0x04,
+		DELETE      = 0x08,
+		MODIFY      = 0x10,
+		RENAME_TO   = 0x20,
+		RENAME_FROM = 0x40,
+		OPEN        = 0x80,
+		CLOSE       = 0x100,
+		ALL_EVENTS  = 0x1FF,
+
+		// watch flags, not reported in events
+		RECURSIVE   = 0x10000  // watch all sub-directories, follow new ones
+	};
+
+	// `path` points into the watcher's buffer, valid during the callback only
+	struct Event {
+		const char* path;
+		size_t len;
+		uint32_t mask;
+
+		std::string str() const { return std::string(path, len); }
+	};
+};
+
+// Interface of the ways to watch paths, driven by an event loop: `get_fd()`
+// is readable when `on_fd_events()` has events to deliver.
+class WatchBackend
+{
+public:
+	typedef std::function<void(const fsevent::Event&)> Callback;
+
+	virtual ~WatchBackend() {}
+
+	// subscribe to events on `path`, return a handle for `remove_watch()`
+	virtual int add_watch(std::string path, uint32_t mask, Callback cb) = 0;
+
+	virtual bool remove_watch(int handle) = 0;
+
+	virtual int get_fd() = 0;
+
+	virtual void on_fd_events(int fd, short events) = 0;
+
+	// number of watched directories, or trees if polled
+	virtual size_t watch_count() = 0;
+};
+
+#endif  // _WATCH_BACKEND_H_
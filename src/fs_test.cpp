@@ -30,6 +30,11 @@ void test_function_scheduler()
 		cout << "schedule " << ++count << " on ticks " << get_milliseconds() << " ...\n";
 	}, milliseconds(500), milliseconds(100));
 
+	scheduler.schedule([]() {
+		cout << "canceled task runs on ticks " << get_milliseconds() << "!\n";
+	}, milliseconds(2000), "cancel me");
+	cout << "cancel: " << scheduler.cancel("cancel me") << "\n";
+
 	this_thread::sleep_for(seconds(3));
 	cout << "shutdown...\n";
 	scheduler.shutdown();
@@ -9,10 +9,10 @@ using namespace std::placeholders;
 
 int main(int argc, char* argv[])
 {
-	FileSystemWatcher fsWatcher([](std::string path, uint32_t mask){
-		printf("EVENT [%x] on %s\n", mask, path.c_str());
+	FileSystemWatcher fsWatcher([](const Event& event){
+		printf("EVENT [%x] on %.*s\n", event.mask, (int) event.len, event.path);
 	});
-	fsWatcher.add_watch("./", CREATE | ATTRIB | MODIFY | DELETE | RENAME_FROM | RENAME_TO);
+	fsWatcher.add_watch("./", CREATE | ATTRIB | MODIFY | DELETE | RENAME_FROM | RENAME_TO | RECURSIVE);
 
 	EpollPoller poller;
 	poller.add_fd(fsWatcher.get_fd(), std::bind(&FileSystemWatcher::on_fd_events, &fsWatcher, _1, _2));
@@ -0,0 +1,212 @@
+//
+// Probes of HealthChecker against local listeners and commands.
+//
+
+#include "EpollPoller.h"
+#include "ListenSocket.h"
+#include "HealthChecker.h"
+#include "ProcessWatcher.h"
+
+#include <unistd.h>
+#include <netinet/in.h>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <iostream>
+#include <condition_variable>
+
+using namespace std;
+using namespace std::placeholders;
+
+static HealthChecker* checker;
+static Metrics metrics;
+static int failed_tests = 0;
+
+static void on_process_exit(pid_t pid, const ProcessWatcher::ProcessInfo& info)
+{
+	checker->on_exit(pid, info.status);
+}
+
+static int port_of(int fd)
+{
+	struct sockaddr_in sa;
+	socklen_t len = sizeof(sa);
+	getsockname(fd, (struct sockaddr*) &sa, &len);
+	return ntohs(sa.sin_port);
+}
+
+// answers "GET /ok" by 200 and "GET /fail" by 500, never answers the rest
+static void serve_http(int fd)
+{
+	vector<int> hung;
+	for (;;) {
+		int sock = accept(fd, NULL, NULL);
+		if (sock < 0) {
+			break;
+		}
+		char buf[1024];
+		ssize_t n = read(sock, buf, sizeof(buf) - 1);
+		buf[n > 0 ? n : 0] = 0;
+		string request(buf);
+		const char* response = nullptr;
+		if (request.compare(0, 8, "GET /ok ") == 0) {
+			response = "HTTP/1.0 200 OK\r\n\r\n";
+		} else if (request.compare(0, 10, "GET /fail ") == 0) {
+			response = "HTTP/1.0 500 Internal Server Error\r\n\r\n";
+		}
+		if (!response) {
+			hung.push_back(sock);
+			continue;
+		}
+		if (write(sock, response, strlen(response)) < 0) {
+			cout << "write failed\n";
+		}
+		close(sock);
+	}
+	for (int sock: hung) {
+		close(sock);
+	}
+}
+
+// run `target` until it fails once, or `wait_ms`, return the reason of
+// the failure, "" if none
+static string probe(const string& target, long wait_ms)
+{
+	HealthChecker::Spec spec = HealthChecker::parse(target);
+	spec.interval_ms = 100;
+	spec.timeout_ms = 300;
+	spec.failures = 1;
+
+	mutex m;
+	condition_variable cond;
+	string reason;
+	bool failed = false;
+	int handle = checker->add(spec, [&](const string& r) {
+		lock_guard<mutex> _l(m);
+		reason = r;
+		failed = true;
+		cond.notify_all();
+	});
+	{
+		unique_lock<mutex> _l(m);
+		cond.wait_for(_l, chrono::milliseconds(wait_ms), [&] { return failed; });
+	}
+	checker->remove(handle);
+	this_thread::sleep_for(chrono::milliseconds(50));  // removed in the loop thread
+	return reason;
+}
+
+static void expect(const string& target, const string& expected, long wait_ms = 1000)
+{
+	Metrics::Counter* ok = metrics.counter("autodeploy_health_probes_total{result=\"ok\"}", "");
+	uint64_t before = ok->value();
+	string reason = probe(target, wait_ms);
+	bool passed = expected.empty() ? reason.empty() && ok->value() > before :
+		reason.compare(0, expected.size(), expected) == 0;
+	cout << (passed ? "ok   " : "FAIL ") << target << ": " <<
+		(reason.empty() ? "healthy" : reason) << "\n";
+	if (!passed) {
+		failed_tests++;
+	}
+}
+
+// a paused probe reports nothing until reset
+static void test_pause()
+{
+	HealthChecker::Spec spec = HealthChecker::parse("exec:/bin/false");
+	spec.interval_ms = 50;
+	spec.failures = 1;
+
+	mutex m;
+	int reports = 0;
+	int handle = checker->add(spec, [&](const string&) {
+		lock_guard<mutex> _l(m);
+		if (++reports == 1) {
+			checker->pause(handle);
+		}
+	});
+	this_thread::sleep_for(chrono::milliseconds(500));
+	int paused = 0;
+	{
+		lock_guard<mutex> _l(m);
+		paused = reports;
+	}
+	checker->reset(handle);
+	this_thread::sleep_for(chrono::milliseconds(300));
+	checker->remove(handle);
+	this_thread::sleep_for(chrono::milliseconds(50));
+
+	bool passed = paused == 1 && reports > 1;
+	cout << (passed ? "ok   " : "FAIL ") << "pause: " << paused << " report(s) paused, " <<
+		reports << " after reset\n";
+	if (!passed) {
+		failed_tests++;
+	}
+}
+
+int main()
+{
+	EpollPoller poller(&metrics);
+	ProcessWatcher process_watcher(on_process_exit, &poller, &metrics);
+	HealthChecker health_checker(&poller, &process_watcher, &metrics);
+	checker = &health_checker;
+
+	if (!process_watcher.use_pidfd()) {
+		poller.add_fd(process_watcher.get_fd(),
+			std::bind(&ProcessWatcher::on_fd_events, &process_watcher, _1, _2), EPOLLIN | EPOLLET);
+	}
+	poller.add_fd(health_checker.get_fd(),
+		std::bind(&HealthChecker::on_fd_events, &health_checker, _1, _2), EPOLLIN | EPOLLET);
+	thread loop(std::bind(&EpollPoller::loop, &poller));
+
+	int http_fd = ListenSocket::open("127.0.0.1:0");
+	string http = "127.0.0.1:" + to_string(port_of(http_fd));
+	thread server(serve_http, http_fd);
+
+	// nobody listens on a port just released
+	int closed_fd = ListenSocket::open("127.0.0.1:0");
+	string closed = "127.0.0.1:" + to_string(port_of(closed_fd));
+	close(closed_fd);
+
+	// a full accept queue drops the SYNs, the connect hangs
+	int full_fd = ListenSocket::open("127.0.0.1:0", 0);
+	string full = "127.0.0.1:" + to_string(port_of(full_fd));
+	vector<int> fillers;
+	for (int i = 0; i < 4; i++) {
+		HealthChecker::Spec spec = HealthChecker::parse("tcp://" + full);
+		int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if (connect(fd, (const struct sockaddr*) &spec.addr, spec.addr_len) < 0 && errno != EINPROGRESS) {
+			cout << "connect failed\n";
+		}
+		fillers.push_back(fd);
+	}
+	this_thread::sleep_for(chrono::milliseconds(100));
+
+	expect("tcp://" + http, "");
+	expect("tcp://" + closed, "connect failed");
+	expect("tcp://" + full, "timed out");
+	expect("http://" + http + "/ok", "");
+	expect("http://" + http + "/fail", "status 500");
+	expect("http://" + http + "/hang", "timed out");
+	expect("http://" + closed + "/ok", "connect failed");
+	expect("exec:/bin/true", "");
+	expect("exec:/bin/sh -c \"exit 3\"", "exit code 3");
+	expect("exec:/bin/sh -c \"kill -9 $$\"", "killed by");
+	expect("exec:/bin/sleep 5", "timed out");
+	expect("exec:/nonexistent/cmd", "exec failed");
+	test_pause();
+
+	for (int fd: fillers) {
+		close(fd);
+	}
+	close(full_fd);
+	shutdown(http_fd, SHUT_RDWR);  // ends the accept loop
+	server.join();
+	close(http_fd);
+	poller.stop();
+	loop.join();
+
+	cout << (failed_tests ? "FAILED " + to_string(failed_tests) : string("PASSED")) << "\n";
+	return failed_tests ? 1 : 0;
+}
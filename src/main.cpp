@@ -1,5 +1,6 @@
 #include "DeployWorker.h"
 #include "RuntimeError.h"
+#include "Logger.h"
 
 #include <limits.h>
 #include <fcntl.h>
@@ -45,9 +46,26 @@ std::string pwd()
 
 int help(const char* prog)
 {
-	printf("Usage: \n\t%s -c,--cmd=args [-w,--watch=path]\n\n"
+	printf("Usage: \n\t%s -c,--cmd=args|-f,--file=services [-w,--watch=path] [-r,--recursive] [-q,--quiet=ms] [--max-latency=ms] [--hash] [--poll] [--start-first] [--notify] [-l,--listen=addr] [--log=path] [--log-format=text|logfmt] [--health=probe] [--max-starting=n] [--metrics=path] [--control=path] [-s,--single-thread] [-v,--verbose]\n\n"
 		       "    [-c|--cmd]=path\targs\tThe command to execute.\n\n"
-		       "    [-w|--watch]=path\tpath\tThe path to monitor.\n\n", prog);
+		       "    [-f|--file]=path\tpath\tThe services file, one [name] section per service.\n\n"
+		       "    [-w|--watch]=path\tpath\tThe path to monitor.\n\n"
+		       "    [-r|--recursive]\tMonitor the whole tree under the path, not only its entries.\n\n"
+		       "    [-q|--quiet]=ms\tms\tRestart after the path is quiet for ms, default 200.\n\n"
+		       "    [--max-latency]=ms\tms\tRestart no later than ms after the first change, default 2000.\n\n"
+		       "    [--hash]\t\tRestart only if file content changed.\n\n"
+		       "    [--poll]\t\tPoll the paths instead of inotify, for NFS, FUSE or volumes of other mount namespaces.\n\n"
+		       "    [--start-first]\tStart the new process before killing the old one.\n\n"
+		       "    [--notify]\t\tWait for READY=1 on $NOTIFY_SOCKET before a process is ready.\n\n"
+		       "    [-l|--listen]=addr\taddr\tListen on host:port and pass the socket as fd 3, may be repeated.\n\n"
+		       "    [--log]=path\tpath\tWrite the output of the command to path, rotated at 10MB.\n\n"
+		       "    [--log-format]=fmt\tfmt\tWrite the own log as text, default, or logfmt key=value lines.\n\n"
+		       "    [--health]=probe\tprobe\tRestart after 3 failed probes of tcp://host:port, http://host:port/path or exec:cmd.\n\n"
+		       "    [--max-starting]=n\tn\tAt most n restarts in progress at a time, default unlimited.\n\n"
+		       "    [--metrics]=path\tpath\tServe Prometheus metrics on a unix socket, @name for abstract.\n\n"
+		       "    [--control]=path\tpath\tAccept deploy, undeploy, restart, status, tail and list requests on a unix socket.\n\n"
+		       "    [-s|--single-thread]\tRun timers and handlers in the event loop thread.\n\n"
+		       "    [-v|--verbose]\t\tLog every file event and signal.\n\n", prog);
 	return 0;
 }
 
@@ -56,8 +74,15 @@ int main(int argc, char const* argv[])
 	bool usage = true;
 	std::string path = pwd();
 	std::vector<std::string> args;
-
-	if (argc < 3) {
+	std::string file;
+	std::vector<std::string> listens;
+	DeployWorker::Policy policy;
+	bool single_thread = false;
+	long max_starting = 0;
+	std::string metrics;
+	std::string control;
+
+	if (argc < 2) {
 		return help(argv[0]);
 	}
 
@@ -66,6 +91,12 @@ int main(int argc, char const* argv[])
 		if ("--cmd" == a || "-c" == a) {
 			args = split(argv[++i]);
 			usage = false;
+		} else if ("--file" == a || "-f" == a) {
+			file = argv[++i];
+			usage = false;
+		} else if (startwith(a, "-f=") || startwith(a, "--file=")) {
+			file = a.substr(a.find('=') + 1);
+			usage = false;
 		} else if ("--watch" == a || "-w" == a) {
 			path = argv[++i];
 		} else if (startwith(a, "-c=") || startwith(a, "--cmd=")) {
@@ -73,6 +104,57 @@ int main(int argc, char const* argv[])
 			usage = false;
 		} else if (startwith(a, "-w=") || startwith(a, "--watch=")) {
 			path = a.substr(a.find('=') + 1);
+		} else if ("--quiet" == a || "-q" == a) {
+			policy.quiet_ms = atol(argv[++i]);
+		} else if (startwith(a, "-q=") || startwith(a, "--quiet=")) {
+			policy.quiet_ms = atol(a.substr(a.find('=') + 1).c_str());
+		} else if ("--single-thread" == a || "-s" == a) {
+			single_thread = true;
+		} else if ("--verbose" == a || "-v" == a) {
+			Logger::set_level(Logger::DEBUG);
+		} else if ("--hash" == a) {
+			policy.content_hash = true;
+		} else if ("--recursive" == a || "-r" == a) {
+			policy.recursive = true;
+		} else if ("--listen" == a || "-l" == a) {
+			listens.push_back(argv[++i]);
+		} else if (startwith(a, "-l=") || startwith(a, "--listen=")) {
+			listens.push_back(a.substr(a.find('=') + 1));
+		} else if ("--log" == a) {
+			policy.log_file = argv[++i];
+		} else if (startwith(a, "--log=")) {
+			policy.log_file = a.substr(a.find('=') + 1);
+		} else if ("--log-format" == a || startwith(a, "--log-format=")) {
+			std::string format = "--log-format" == a ? argv[++i] : a.substr(a.find('=') + 1);
+			Logger::set_format(format == "logfmt" ? Logger::LOGFMT : Logger::TEXT);
+		} else if ("--health" == a) {
+			policy.health = argv[++i];
+		} else if (startwith(a, "--health=")) {
+			policy.health = a.substr(a.find('=') + 1);
+		} else if ("--max-starting" == a) {
+			max_starting = atol(argv[++i]);
+		} else if (startwith(a, "--max-starting=")) {
+			max_starting = atol(a.substr(a.find('=') + 1).c_str());
+		} else if ("--metrics" == a) {
+			metrics = argv[++i];
+		} else if (startwith(a, "--metrics=")) {
+			metrics = a.substr(a.find('=') + 1);
+		} else if ("--control" == a) {
+			control = argv[++i];
+			usage = false;
+		} else if (startwith(a, "--control=")) {
+			control = a.substr(a.find('=') + 1);
+			usage = false;
+		} else if ("--poll" == a) {
+			policy.watch_mode = DeployWorker::Policy::WATCH_POLL;
+		} else if ("--notify" == a) {
+			policy.notify = true;
+		} else if ("--start-first" == a) {
+			policy.strategy = DeployWorker::Policy::START_FIRST;
+		} else if ("--max-latency" == a) {
+			policy.max_latency_ms = atol(argv[++i]);
+		} else if (startwith(a, "--max-latency=")) {
+			policy.max_latency_ms = atol(a.substr(a.find('=') + 1).c_str());
 		} else if ("--help" == a || "-h") {
 			usage = true;
 		}
@@ -82,10 +164,28 @@ int main(int argc, char const* argv[])
 		return help(argv[0]);
 	}
 
-	printf("path: %s\n", path.c_str());
-	printf("args: %zu\n", args.size());
-	for (auto &a: args) {
-		printf("%s\n", a.c_str());
+	std::vector<ServiceSpec> specs;
+	if (file.size()) {
+		specs = ServiceConfig::load(file);
+	}
+	if (args.size()) {
+		ServiceSpec spec;
+		spec.args = args;
+		spec.paths.push_back(path);
+		spec.listens = listens;
+		spec.policy = policy;
+		specs.push_back(spec);
+	}
+
+	for (auto& spec: specs) {
+		LOGI("service: %s", spec.name.c_str());
+		for (auto& p: spec.paths) {
+			LOGI("path: %s", p.c_str());
+		}
+		LOGI("args: %zu", spec.args.size());
+		for (auto &a: spec.args) {
+			LOGI("%s", a.c_str());
+		}
 	}
 
 	if (pipe2(sig_pipe, O_CLOEXEC) < 0) {
@@ -93,11 +193,20 @@ int main(int argc, char const* argv[])
 	}
 	signal(SIGTERM, handle_signal);
 
-	DeployWorker worker;
+	DeployWorker worker(single_thread);
+	worker.set_max_starting(max_starting);
+	if (metrics.size()) {
+		worker.set_metrics_socket(metrics);
+	}
+	if (control.size()) {
+		worker.set_control_socket(control);
+	}
 	worker.start();
 
 
-	worker.deploy(args, path);
+	for (auto& spec: specs) {
+		worker.deploy(spec);
+	}
 
 	int sig = 0;
 	while (read(sig_pipe[0], &sig, sizeof(sig)) >= 0) {